@@ -0,0 +1,121 @@
+//-----------------------------------------------------------------------------
+// Benchmark of concurrent_hash_array_mapped_trie against a std::unordered_map
+// guarded by a mutex, with several reader threads and one writer thread
+//
+// Build and run (from the root of the repository):
+//    g++ -std=c++17 -O2 -pthread -Iinclude bench/concurrent_hamt.cpp -o concurrent_hamt
+//    ./concurrent_hamt [reader_count] [writer_pause_us]
+//-----------------------------------------------------------------------------
+
+#include <concurrent_hamt.hpp>
+#include <timer.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+static const int KeyCount = 100000;
+static const int ReadsPerThread = 2000000;
+
+class locked_map
+{
+public:
+   bool find(int key) const
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_map.count(key) != 0;
+   }
+
+   void insert(int key, int value)
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_map[key] = value;
+   }
+
+private:
+   mutable std::mutex           m_mutex;
+   std::unordered_map<int, int> m_map;
+};
+
+class concurrent_map
+{
+public:
+   bool find(int key) const
+   {
+      return m_map.count(key) != 0;
+   }
+
+   void insert(int key, int value)
+   {
+      m_map.update([&](auto& t) { t.erase(key); t.insert({ key, value }); });
+   }
+
+private:
+   concurrent_hash_array_mapped_trie<int, int> m_map;
+};
+
+/** The readers do a fixed number of finds, while the writer updates keys, pausing between updates */
+template<typename Map>
+void run(std::string const& name, std::size_t reader_count, int writer_pause_us)
+{
+   Map map;
+   for (int k = 0; k < KeyCount; k += 2)
+      map.insert(k, k);
+
+   std::atomic<bool> done(false);
+   std::atomic<long> found(0);
+   std::atomic<long> writes(0);
+   auto elapsed = time_it<std::milli>([&] {
+      std::thread writer([&] {
+         std::mt19937 gen(0);
+         while (!done)
+         {
+            map.insert(gen() % KeyCount, 0);
+            ++writes;
+            if (writer_pause_us > 0)
+               std::this_thread::sleep_for(std::chrono::microseconds(writer_pause_us));
+         }
+      });
+
+      std::vector<std::thread> readers;
+      for (std::size_t r = 0; r < reader_count; ++r)
+      {
+         readers.emplace_back([&, r] {
+            std::mt19937 gen(static_cast<unsigned>(r + 1));
+            long local = 0;
+            for (int i = 0; i < ReadsPerThread; ++i)
+               local += map.find(gen() % KeyCount);
+            found += local;
+         });
+      }
+      for (auto& reader : readers)
+         reader.join();
+      done = true;
+      writer.join();
+   });
+
+   double reads = double(reader_count) * ReadsPerThread;
+   std::cout << " - " << name << ": " << elapsed.count() << " ms, "
+             << reads / elapsed.count() / 1000 << " M reads/s, "
+             << writes << " writes (" << found << " found)" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+   std::size_t reader_count = argc > 1 ? std::atoi(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+   int writer_pause_us = argc > 2 ? std::atoi(argv[2]) : 0;
+
+   std::cout << reader_count << " readers, 1 writer" << std::endl;
+   run<locked_map>("mutex + std::unordered_map", reader_count, writer_pause_us);
+   run<concurrent_map>("concurrent_hash_array_mapped_trie", reader_count, writer_pause_us);
+   return 0;
+}
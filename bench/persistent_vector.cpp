@@ -0,0 +1,71 @@
+//-----------------------------------------------------------------------------
+// Benchmark of the allocation of the nodes of persistent_vector, for both
+// threading policies, with one or several threads allocating concurrently
+// - Each thread builds vectors by push_back, derives persistent versions of
+//   them with set (each one copying a path of nodes) then drops them all
+// - The time is the one of the slowest thread
+//
+// Build and run (from the root of the repository):
+//    g++ -std=c++17 -O2 -pthread -Iinclude bench/persistent_vector.cpp -o persistent_vector
+//    ./persistent_vector [thread_count]
+//-----------------------------------------------------------------------------
+
+#include <persistent_vector.hpp>
+#include <timer.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+static const int Rounds = 20;
+static const int VectorSize = 100000;
+static const int VersionCount = 20000;
+
+template<typename Threading>
+long churn(unsigned seed)
+{
+   std::mt19937 gen(seed);
+   long checksum = 0;
+   for (int round = 0; round < Rounds; ++round)
+   {
+      persistent_vector<int, Threading> v;
+      for (int i = 0; i < VectorSize; ++i)
+         v = std::move(v).push_back(i);
+
+      std::vector<persistent_vector<int, Threading>> versions;
+      versions.reserve(VersionCount);
+      for (int i = 0; i < VersionCount; ++i)
+         versions.push_back(v.set(gen() % VectorSize, i));
+      checksum += versions.back().at(0);
+   }
+   return checksum;
+}
+
+template<typename Threading>
+void run(std::string const& name, std::size_t thread_count)
+{
+   std::vector<long> checksums(thread_count);
+   auto elapsed = time_it<std::milli>([&] {
+      std::vector<std::thread> threads;
+      for (std::size_t t = 0; t < thread_count; ++t)
+         threads.emplace_back([&checksums, t] { checksums[t] = churn<Threading>(static_cast<unsigned>(t)); });
+      for (auto& thread : threads)
+         thread.join();
+   });
+   std::cout << " - " << name << ": " << elapsed.count() << " ms" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+   std::size_t thread_count = argc > 1 ? std::atoi(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+
+   std::cout << thread_count << " threads" << std::endl;
+   run<details::multi_threaded>("multi_threaded", thread_count);
+   run<details::single_threaded>("single_threaded", thread_count);
+   return 0;
+}
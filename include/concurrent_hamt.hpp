@@ -0,0 +1,148 @@
+#pragma once
+
+#include <hamt.hpp>
+#include <internal/epochs.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+
+/**
+ * A hash array mapped trie shared between many readers and a writer
+ *
+ * Readers never lock: they load the current version of the trie and read
+ * it as an immutable snapshot. The writer (updates are serialized) copies
+ * the current version, which shares all its nodes, updates the copy (only
+ * copying the paths it changes) and publishes it by swapping a pointer.
+ *
+ * Retired versions are destroyed once no reader can still be reading them,
+ * using epoch based reclamation. Destroying a version only frees the nodes
+ * it does not share with the more recent versions. This is attempted at each
+ * update, and on demand with 'reclaim' (after a burst of updates).
+ */
+template<
+   typename key_type,
+   typename value_type,
+   typename hasher = std::hash<key_type>,
+   typename key_equal = std::equal_to<key_type>
+>
+class concurrent_hash_array_mapped_trie
+{
+public:
+   using trie_type = hash_array_mapped_trie<key_type, value_type, hasher, key_equal>;
+
+   explicit concurrent_hash_array_mapped_trie(trie_type const& initial = trie_type())
+      : m_epochs(), m_current(new trie_type(initial)), m_writer(), m_retired()
+   {}
+
+   ~concurrent_hash_array_mapped_trie()
+   {
+      m_retired.clear();
+      delete m_current.load();
+   }
+
+   concurrent_hash_array_mapped_trie(concurrent_hash_array_mapped_trie const&) = delete;
+   concurrent_hash_array_mapped_trie& operator=(concurrent_hash_array_mapped_trie const&) = delete;
+
+   //--------------------------------------------------------------------------
+   // Readers: the trie given to 'reader' must not escape the call
+   //--------------------------------------------------------------------------
+
+   template<typename Reader>
+   auto read(Reader reader) const
+   {
+      details::epoch_guard guard(m_epochs);
+      return reader(*m_current.load());
+   }
+
+   template<typename K>
+   std::optional<value_type> find(K const& key) const
+   {
+      return read([&key](trie_type const& t) {
+         value_type const* found = t.find(key);
+         return found ? std::optional<value_type>(*found) : std::nullopt;
+      });
+   }
+
+   template<typename K>
+   std::size_t count(K const& key) const
+   {
+      return read([&key](trie_type const& t) { return t.count(key); });
+   }
+
+   std::size_t size() const
+   {
+      return read([](trie_type const& t) { return t.size(); });
+   }
+
+   trie_type snapshot() const
+   {
+      return read([](trie_type const& t) { return t; });
+   }
+
+   //--------------------------------------------------------------------------
+   // Writer: 'writer' updates a new version, published when it returns
+   //--------------------------------------------------------------------------
+
+   template<typename Writer>
+   void update(Writer writer)
+   {
+      std::lock_guard<std::mutex> lock(m_writer);
+      std::unique_ptr<trie_type> next(new trie_type(*m_current.load()));
+      writer(*next);
+      publish(std::move(next));
+   }
+
+   bool insert(std::pair<key_type, value_type> const& pair)
+   {
+      bool added = false;
+      update([&](trie_type& t) { added = t.insert(pair); });
+      return added;
+   }
+
+   std::size_t erase(key_type const& key)
+   {
+      std::size_t erased = 0;
+      update([&](trie_type& t) { erased = t.erase(key); });
+      return erased;
+   }
+
+   /**
+    * Destroy the retired versions that no reader can still be reading: can
+    * be called by any thread, including from a reader, but not from a writer
+    */
+   void reclaim()
+   {
+      std::lock_guard<std::mutex> lock(m_writer);
+      reclaim_retired();
+   }
+
+private:
+   using retired_version = std::pair<std::uint64_t, std::unique_ptr<trie_type>>;
+
+   mutable details::epoch_domain m_epochs;
+   std::atomic<trie_type*>       m_current;
+   std::mutex                    m_writer;
+   std::vector<retired_version>  m_retired;
+
+   void publish(std::unique_ptr<trie_type> next)
+   {
+      trie_type* previous = m_current.exchange(next.release());
+      m_retired.emplace_back(m_epochs.advance(), std::unique_ptr<trie_type>(previous));
+      reclaim_retired();
+   }
+
+   void reclaim_retired()
+   {
+      std::uint64_t oldest = m_epochs.oldest_active();
+      m_retired.erase(
+         std::remove_if(m_retired.begin(), m_retired.end(), [oldest](retired_version const& r) { return r.first < oldest; }),
+         m_retired.end());
+   }
+};
@@ -1,14 +1,24 @@
 #ifndef COUNTING_SORT_HPP
 #define COUNTING_SORT_HPP
 
+#include <internal/counting_sort.hpp>
+#include <internal/parallel.hpp>
+
 #include <algorithm>
 #include <iterator>
+#include <memory>
+#include <numeric>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 
 //-----------------------------------------------------------------------------
 // Counting sort
 // Sort in linear time, if the inputs can be projected in [0..M] integer space
+// - Stable: the elements with the same projection keep their relative order
+// - The projections are computed once, then the elements are moved once to a
+//   buffer and once to their sorted position
 //-----------------------------------------------------------------------------
 
 template<typename InoutIterator, typename ProjectionIt>
@@ -18,28 +28,92 @@ void counting_sort(InoutIterator first, InoutIterator last,
    if (first == last)
       return;
 
-   using ValueType = typename std::iterator_traits<InoutIterator>::value_type;
-   auto proj_value_range = std::minmax_element(proj_first, proj_last);
-   auto min_proj = *proj_value_range.first;
-   auto max_proj = *proj_value_range.second;
-
-   std::vector<std::vector<ValueType>> counts(max_proj - min_proj + 1);
-   for (auto curr = first; curr != last; ++curr, ++proj_first)
-      counts[*proj_first - min_proj].push_back(std::move(*curr));
-
-   for (auto& vals : counts)
-      first = std::move(begin(vals), end(vals), first);
+   auto buckets = details::count_keys(proj_first, proj_last);
+   details::scatter_by_keys(first, last, proj_first, buckets);
 }
 
 template<typename InoutIterator, typename Projection>
 void counting_sort(InoutIterator first, InoutIterator last, Projection proj)
 {
-   std::vector<size_t> proj_values;
-   std::transform(first, last, std::back_inserter(proj_values), proj);
-   counting_sort(first, last, begin(proj_values), end(proj_values));
+   if (first == last)
+      return;
+
+   using Key = std::decay_t<decltype(proj(*first))>;
+   std::vector<Key> proj_values;
+   auto buckets = details::project_keys(first, last, proj, proj_values);
+   details::scatter_by_keys(first, last, begin(proj_values), buckets);
+}
+
+/**
+ * Stable counting sort of [first, last) into the range starting at 'out',
+ * without intermediary buffer: the input is read twice (once to project the
+ * keys, once to copy the elements), so it must be a forward range
+ */
+template<typename ForwardIterator, typename RandomOutputIterator, typename Projection>
+RandomOutputIterator counting_sort_copy(ForwardIterator first, ForwardIterator last, RandomOutputIterator out, Projection proj)
+{
+   if (first == last)
+      return out;
+
+   using Key = std::decay_t<decltype(proj(*first))>;
+   std::vector<Key> proj_values;
+   auto buckets = details::project_keys(first, last, proj, proj_values);
+   for (auto& key : proj_values)
+      out[buckets.next_slot(key)] = *first++;
+   return out + proj_values.size();
 }
 
 
+//-----------------------------------------------------------------------------
+// Parallel counting sort, on up to 'thread_count' threads
+// - Each thread projects and counts the keys of a range of the input
+// - A prefix sum over all the counts gives each range its own slots in each
+//   bucket, so that the threads scatter their range without synchronization
+//   and the sort stays stable
+// - The elements must be default constructible (for the buffer)
+//-----------------------------------------------------------------------------
+
+template<typename RandomIterator, typename Projection>
+void parallel_counting_sort(RandomIterator first, RandomIterator last, Projection proj,
+                            std::size_t thread_count = details::default_thread_count())
+{
+   if (first == last)
+      return;
+
+   using ValueType = typename std::iterator_traits<RandomIterator>::value_type;
+   using Key = std::decay_t<decltype(proj(*first))>;
+   static_assert(std::is_integral<Key>::value, "Counting sort requires integer keys");
+
+   std::size_t size = last - first;
+   std::size_t range_count = std::max<std::size_t>(1, std::min(thread_count, size));
+   auto range_start = [=](std::size_t r) { return details::chunk_start(size, range_count, r); };
+
+   std::unique_ptr<Key[]> keys(new Key[size]);
+   std::vector<std::pair<Key, Key>> key_ranges(range_count);
+   details::parallel_for(range_count, [&](std::size_t r) {
+      std::transform(first + range_start(r), first + range_start(r + 1), keys.get() + range_start(r), proj);
+      auto minmax = std::minmax_element(keys.get() + range_start(r), keys.get() + range_start(r + 1));
+      key_ranges[r] = { *minmax.first, *minmax.second };
+   }, thread_count);
+
+   Key min_key = std::min_element(begin(key_ranges), end(key_ranges))->first;
+   Key max_key = std::max_element(begin(key_ranges), end(key_ranges), [](auto& lhs, auto& rhs) { return lhs.second < rhs.second; })->second;
+   std::vector<details::key_buckets<Key>> buckets(range_count, details::key_buckets<Key>(min_key, max_key));
+   details::parallel_for(range_count, [&](std::size_t r) {
+      buckets[r].count(keys.get() + range_start(r), keys.get() + range_start(r + 1));
+   }, thread_count);
+   details::key_buckets<Key>::prefix_sum(buckets);
+
+   std::unique_ptr<ValueType[]> buffer(new ValueType[size]);
+   details::parallel_for(range_count, [&](std::size_t r) {
+      for (std::size_t i = range_start(r); i < range_start(r + 1); ++i)
+         buffer[buckets[r].next_slot(keys[i])] = std::move(first[i]);
+   }, thread_count);
+   details::parallel_for(range_count, [&](std::size_t r) {
+      std::move(buffer.get() + range_start(r), buffer.get() + range_start(r + 1), first + range_start(r));
+   }, thread_count);
+}
+
 //-----------------------------------------------------------------------------
 // Counting sort in place for random access iterators
 // Sort in linear time, if the inputs can be projected in [0..M] integer space
@@ -51,41 +125,22 @@ void counting_sort_in_place(InoutIterator first, InoutIterator last, Projection
    if (first == last)
       return;
 
-   using ValueType = typename std::iterator_traits<InoutIterator>::value_type;
    auto proj_value_range = std::minmax_element(first, last, [&proj](auto& lhs, auto& rhs) { return proj(lhs) < proj(rhs); });
    auto min_proj = proj(*proj_value_range.first);
    auto max_proj = proj(*proj_value_range.second);
    auto proj_gap = max_proj - min_proj + 1;
 
-   //Cout each occurrences
-   std::vector<size_t> counts(proj_gap);
+   //Count each occurrences, and compute the ranges
+   std::vector<size_t> ends(proj_gap);
    for (auto curr = first; curr != last; ++curr)
-      counts[proj(*curr) - min_proj] += 1;
-
-   //Compute the ranges
-   std::vector<InoutIterator> starts(proj_gap, first);
-   for (decltype(proj_gap) i = 1; i < proj_gap; ++i)
-      starts[i] = std::next(starts[i - 1], counts[i - 1]); //Linear complexity but for random access iterators
-   std::vector<InoutIterator> ends = starts;
-
-   //Loop on the ranges
-   for (decltype(proj_gap) i = 0; i < proj_gap - 1; ++i)
-   {
-      while (ends[i] != starts[i+1])
-      {
-         auto& elem = *(ends[i]);
-         auto proj_val = proj(elem) - min_proj;
-         if (proj_val == i)
-         {
-            ++(ends[i]);
-         }
-         else
-         {
-            std::swap(elem, *ends[proj_val]);
-            ++(ends[proj_val]);
-         }
-      }
-   }
+      ends[proj(*curr) - min_proj] += 1;
+   std::partial_sum(begin(ends), end(ends), begin(ends));
+
+   std::vector<size_t> nexts(proj_gap);
+   std::copy(begin(ends), end(ends) - 1, begin(nexts) + 1);
+   details::permute_to_buckets(nexts, ends,
+      [&](size_t i) { return static_cast<size_t>(proj(first[i]) - min_proj); },
+      [&](size_t i, size_t j) { std::iter_swap(first + i, first + j); });
 }
 
 
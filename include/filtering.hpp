@@ -1,46 +1,141 @@
 #ifndef FILTERING_HPP
 #define FILTERING_HPP
 
+#include <internal/filtering.hpp>
+#include <internal/parallel.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
 
+//-----------------------------------------------------------------------------
+// Keep the elements satisfying the predicate at the beginning of the range,
+// and return the end of the kept elements
+// - Contiguous ranges of trivially copyable 4 or 8 bytes elements (ints,
+//   floats, pointers...) are compacted by blocks with SIMD instructions
+//-----------------------------------------------------------------------------
 
 template<typename ForwardIt, typename Predicate>
 ForwardIt filter_if(ForwardIt first, ForwardIt last, Predicate pred)
 {
-   ForwardIt last_valid = first;
-   for (; first != last; ++first)
+   if constexpr (details::is_compactable_range<ForwardIt>)
    {
-      if (!pred(*first))
-         continue;
-      
-      *last_valid = std::move(*first);
-      ++last_valid;
+      return details::compact_range(first, last, pred);
+   }
+   else
+   {
+      //No moves until the first rejected element (moving an element on itself may empty it)
+      first = std::find_if_not(first, last, std::ref(pred));
+      if (first == last)
+         return first;
+
+      ForwardIt last_valid = first;
+      for (++first; first != last; ++first)
+      {
+         if (!pred(*first))
+            continue;
+         
+         *last_valid = std::move(*first);
+         ++last_valid;
+      }
+      return last_valid;
    }
-   return last_valid;
 }
 
 //-----------------------------------------------------------------------------
 
+/** Same as filter_if, but the kept elements may be reordered */
 template<typename BidirectionalIt, typename Predicate>
 BidirectionalIt unstable_filter_if(BidirectionalIt first, BidirectionalIt last, Predicate pred)
 {
-   if (first == last)
-      return first;
-
-   while (first != last)
+   if constexpr (details::is_compactable_range<BidirectionalIt>)
    {
-      if (!pred(*first))
-      {
-         --last;
-         *first = std::move(*last);
-      }
-      else
+      return details::compact_range(first, last, pred);
+   }
+   else
+   {
+      if (first == last)
+         return first;
+
+      while (first != last)
       {
-         ++first;
+         if (!pred(*first))
+         {
+            --last;
+            *first = std::move(*last);
+         }
+         else
+         {
+            ++first;
+         }
       }
+      return last;
    }
-   return last;
 }
 
 
+//-----------------------------------------------------------------------------
+// Parallel filter_if, on up to 'thread_count' threads
+// - The range is split in blocks, each block filtered in place concurrently
+// - A prefix sum of the number of elements kept by each block gives their
+//   final position. In place, a block could overwrite the elements of a
+//   previous block not moved yet, so the blocks are moved in parallel through
+//   an uninitialized buffer the size of the elements that need to move
+// - Elements whose moves may throw are moved sequentially, without buffer
+// - The predicate is called concurrently, on copies of 'pred'
+//-----------------------------------------------------------------------------
+
+template<typename RandomIt, typename Predicate>
+RandomIt parallel_filter_if(RandomIt first, RandomIt last, Predicate pred,
+                            std::size_t thread_count = details::default_thread_count())
+{
+   using ValueType = typename std::iterator_traits<RandomIt>::value_type;
+   const std::size_t TasksPerThread = 8;
+
+   std::size_t size = last - first;
+   std::size_t block_count = std::min(size, TasksPerThread * thread_count);
+   if (thread_count <= 1 || block_count <= 1)
+      return filter_if(first, last, pred);
+
+   auto block_start = [=](std::size_t b) { return first + details::chunk_start(size, block_count, b); };
+   std::vector<std::size_t> kept(block_count + 1, 0);
+   details::parallel_for(block_count, [&](std::size_t b) {
+      kept[b + 1] = filter_if(block_start(b), block_start(b + 1), pred) - block_start(b);
+   }, thread_count);
+
+   std::vector<std::size_t> offsets(block_count + 1);
+   std::partial_sum(begin(kept), end(kept), begin(offsets));
+
+   if constexpr (!std::is_nothrow_move_constructible<ValueType>::value || !std::is_nothrow_move_assignable<ValueType>::value)
+   {
+      for (std::size_t b = 1; b < block_count; ++b)
+         std::move(block_start(b), block_start(b) + kept[b + 1], first + offsets[b]);
+   }
+   else
+   {
+      std::size_t first_kept = offsets[1];
+      std::size_t moved = offsets.back() - first_kept;
+      std::allocator<ValueType> allocator;
+      ValueType* buffer = allocator.allocate(moved);
+      details::parallel_for(block_count - 1, [&](std::size_t b) {
+         std::uninitialized_move(block_start(b + 1), block_start(b + 1) + kept[b + 2], buffer + offsets[b + 1] - first_kept);
+      }, thread_count);
+
+      details::parallel_for(block_count, [&](std::size_t b) {
+         ValueType* from = buffer + details::chunk_start(moved, block_count, b);
+         ValueType* to = buffer + details::chunk_start(moved, block_count, b + 1);
+         std::move(from, to, first + first_kept + (from - buffer));
+         std::destroy(from, to);
+      }, thread_count);
+      allocator.deallocate(buffer, moved);
+   }
+   return first + offsets.back();
+}
+
 #endif
@@ -1,12 +1,18 @@
 #ifndef FIND_PEAK_HPP
 #define FIND_PEAK_HPP
 
+#include <internal/find_peak.hpp>
+
+#include <array>
+#include <cstddef>
+#include <functional>
 #include <iterator>
 
 
 //-----------------------------------------------------------------------------
 // Find the peak of a function, for random access iterators (binary search use)
-// Complexity is O(log(n))
+// Complexity is O(log(n)), with a single comparison per step, and no branch
+// on its result once the range is small enough to be in cache
 //-----------------------------------------------------------------------------
 
 template<typename Iterator>
@@ -19,18 +25,13 @@ template<typename RandomAccessIterator, typename Less>
 auto find_peak_impl(RandomAccessIterator first, RandomAccessIterator last,
                     Less less, std::random_access_iterator_tag)
 {
-   while (true)
-   {
-      auto curr = first + std::distance(first, last) / 2;
-      if (curr == first)
-         return curr;
-
-      auto prev = curr - 1;
-      auto next = curr + 1;
-      if      (less(*curr, *prev))  last = curr;
-      else if (less(*curr, *next))  first = next;
-      else                          return curr;
-   }
+   const std::size_t BranchlessSize = 256;
+   auto search = details::start_peak_search(first, last);
+   while (search.m_size > BranchlessSize)
+      search.narrow(less);
+   while (!search.done())
+      search.step(less);
+   return search.m_first;
 }
 
 template<typename ForwardIterator, typename Less>
@@ -69,4 +70,48 @@ auto find_peak(Container const& container, Less less = Less())
 }
 
 
+//-----------------------------------------------------------------------------
+// Find the peaks of a batch of ranges (whole arrays or sub-ranges of one)
+// - Each query is a pair of random access iterators, its peak written to out
+// - The searches of up to 16 queries are advanced in turn, one branchless
+//   step each, so that their cache misses overlap instead of being paid one
+//   after the other
+//-----------------------------------------------------------------------------
+
+template<typename QueryIterator>
+using DefLessQuery = DefLessIter<typename std::iterator_traits<QueryIterator>::value_type::first_type>;
+
+template<typename QueryIterator, typename OutputIterator, typename Less = DefLessQuery<QueryIterator>>
+OutputIterator find_peaks(QueryIterator first, QueryIterator last, OutputIterator out, Less less = Less())
+{
+   using iterator = typename std::iterator_traits<QueryIterator>::value_type::first_type;
+   const std::size_t BatchSize = 16;
+
+   std::array<details::peak_search<iterator>, BatchSize> searches;
+   while (first != last)
+   {
+      std::size_t count = 0;
+      for (; first != last && count < BatchSize; ++first, ++count)
+         searches[count] = details::start_peak_search(first->first, first->second);
+
+      for (bool active = true; active;)
+      {
+         active = false;
+         for (std::size_t i = 0; i < count; ++i)
+         {
+            if (!searches[i].done())
+            {
+               searches[i].step(less);
+               active = true;
+            }
+         }
+      }
+
+      for (std::size_t i = 0; i < count; ++i)
+         *out++ = searches[i].m_first;
+   }
+   return out;
+}
+
+
 #endif
@@ -1,8 +1,18 @@
 #ifndef FOLD_BALANCED_HPP
 #define FOLD_BALANCED_HPP
 
+#include <internal/fold_balanced.hpp>
+#include <internal/parallel.hpp>
+
 #include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
 #include <numeric>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 
 //-----------------------------------------------------------------------------
@@ -10,21 +20,128 @@
 // @require:
 // - The operation to be associative
 // - The operation to work on two results (elements scanned are results too)
+// - Each pending partial result folds a number of elements: a new partial is
+//   combined with the previous ones as long as they do not fold more elements
+//   than it does (with one element at a time, this is a binary counter whose
+//   partials fold the powers of two of the bits of the count)
+// - Partials from another accumulator can be appended with their counts, so
+//   that accumulators of different threads, shards or time windows can be
+//   merged, and the partials saved and restored to resume the accumulation
 //-----------------------------------------------------------------------------
 
 template<typename BinaryOp, typename Result>
 class BalancedAccumulator
 {
 public:
+   /** The pending partial results, oldest first, with the number of elements each one folds */
+   using Snapshot = std::vector<std::pair<Result, size_t>>;
+
    BalancedAccumulator(BinaryOp op, size_t counter_size)
-      : m_op(op), m_results(), m_count(0)
+      : m_op(op), m_results(), m_counts(), m_count(0)
    {
       m_results.reserve(counter_size);
    }
-   
+
+   BalancedAccumulator(BinaryOp op, Snapshot snapshot)
+      : m_op(op), m_results(), m_counts(), m_count(0)
+   {
+      restore(std::move(snapshot));
+   }
+
    void operator()(Result res)
    {
-      size_t relative_count = m_count++;
+      if (m_counts.empty())
+         carry(std::move(res), m_count++);
+      else
+         push_partial(std::move(res), 1);
+   }
+
+   /** Append a partial result folding 'count' (at least one) elements, after the ones accumulated */
+   void push(Result res, size_t count)
+   {
+      if (m_counts.empty() && is_power_of_two(count) && m_count % count == 0)
+      {
+         carry(std::move(res), m_count / count);
+         m_count += count;
+      }
+      else
+      {
+         push_partial(std::move(res), count);
+      }
+   }
+
+   /** Append the elements accumulated by 'other', as if they came after the ones of this accumulator */
+   void merge(BalancedAccumulator const& other)
+   {
+      push_all(other.snapshot());
+   }
+
+   void merge(BalancedAccumulator&& other)
+   {
+      for (size_t i = 0; i < other.m_results.size(); ++i)
+         push(std::move(other.m_results[i]), other.count_at(i));
+      other.clear();
+   }
+
+   Snapshot snapshot() const
+   {
+      Snapshot partials;
+      partials.reserve(m_results.size());
+      for (size_t i = 0; i < m_results.size(); ++i)
+         partials.emplace_back(m_results[i], count_at(i));
+      return partials;
+   }
+
+   /** Replace the state of the accumulator by the one of a snapshot */
+   void restore(Snapshot snapshot)
+   {
+      clear();
+      push_all(std::move(snapshot));
+   }
+
+   void clear()
+   {
+      m_results.clear();
+      m_counts.clear();
+      m_count = 0;
+   }
+
+   bool empty() const
+   {
+      return m_results.empty();
+   }
+
+   /** Number of elements accumulated */
+   size_t count() const
+   {
+      return m_count;
+   }
+
+   Result finalize(Result res)
+   {
+      return std::accumulate(begin(m_results), end(m_results), res, m_op);
+   }
+
+   /** Fold of the accumulated elements alone, which requires at least one */
+   Result finalize()
+   {
+      return std::accumulate(std::next(begin(m_results)), end(m_results), m_results.front(), m_op);
+   }
+
+private:
+   BinaryOp            m_op;
+   std::vector<Result> m_results;
+   std::vector<size_t> m_counts;  // Empty as long as the partials are the ones of a binary counter
+   size_t              m_count;
+
+   static bool is_power_of_two(size_t count)
+   {
+      return count != 0 && (count & (count - 1)) == 0;
+   }
+
+   /** Add one to the binary counter whose value is the 'relative_count' */
+   void carry(Result res, size_t relative_count)
+   {
       while (true)
       {
          if (relative_count % 2 == 0)
@@ -39,23 +156,72 @@ public:
       }
    }
 
-   Result finalize(Result res)
+   size_t count_at(size_t i) const
    {
-      return std::accumulate(begin(m_results), end(m_results), res, m_op);
+      if (!m_counts.empty())
+         return m_counts[i];
+
+      size_t bit = size_t(1) << (8 * sizeof(size_t) - 1);
+      for (size_t seen = 0; ; bit >>= 1)
+      {
+         if ((m_count & bit) && seen++ == i)
+            return bit;
+      }
    }
 
-private:
-   BinaryOp            m_op;
-   std::vector<Result> m_results;
-   size_t              m_count;
+   void push_partial(Result res, size_t count)
+   {
+      if (m_counts.empty())
+      {
+         std::vector<size_t> counts;
+         for (size_t i = 0; i < m_results.size(); ++i)
+            counts.push_back(count_at(i));
+         m_counts = std::move(counts);
+      }
+
+      m_count += count;
+      while (!m_counts.empty() && m_counts.back() <= count)
+      {
+         res = m_op(m_results.back(), res);
+         count += m_counts.back();
+         m_results.pop_back();
+         m_counts.pop_back();
+      }
+      m_results.push_back(std::move(res));
+      m_counts.push_back(count);
+   }
+
+   void push_all(Snapshot partials)
+   {
+      for (auto& partial : partials)
+         push(std::move(partial.first), partial.second);
+   }
 };
 
+/**
+ * Sums and products of numbers (with std::plus or std::multiplies) are folded
+ * by leaves of 128 elements, each one reduced with SIMD-friendly lanes, and
+ * the elements after the last leaf are folded apart then appended
+ */
 template<typename FwdIterator, typename Result, typename BinaryOp>
 Result fold_balanced(FwdIterator first, FwdIterator last, Result init, BinaryOp op)
 {
+   using leaves = details::balanced_leaves<FwdIterator, Result, BinaryOp>;
    BalancedAccumulator<BinaryOp, Result> accOp(op, 64);
-   std::for_each(first, last, std::ref(accOp));
-   return accOp.finalize(init);
+   if constexpr (leaves::Size == 1)
+   {
+      std::for_each(first, last, std::ref(accOp));
+      return accOp.finalize(init);
+   }
+   else
+   {
+      for (; std::size_t(last - first) >= leaves::Size; first += leaves::Size)
+         accOp(leaves::reduce(first, op));
+
+      BalancedAccumulator<BinaryOp, Result> restAccOp(op, leaves::Bits + 1);
+      std::for_each(first, last, std::ref(restAccOp));
+      return restAccOp.finalize(accOp.finalize(init));
+   }
 }
 
 template<typename Container, typename Result, typename BinaryOp>
@@ -65,4 +231,204 @@ Result fold_balanced(Container const& container, Result init, BinaryOp op)
 }
 
 
+//-----------------------------------------------------------------------------
+// Parallel version of fold_balanced, on up to 'thread_count' threads
+// - The accumulator folds each aligned block of 2^k elements as a perfect
+//   binary tree, so the range is cut in blocks of a fixed size, folded
+//   independently, and their results folded by another accumulator, as if
+//   they were elements of the upper levels of the tree
+// - The elements after the last full block are folded sequentially, and
+//   their partial results appended after the ones of the blocks
+// - The blocks are made of the same leaves as in fold_balanced
+// => The operations are exactly the ones of fold_balanced, in the same order,
+//    whatever the number of threads: the result is bit-identical, even for
+//    floating point numbers or non commutative operations
+// - The blocks are picked dynamically by the threads, so that blocks of
+//   uneven costs balance out
+//-----------------------------------------------------------------------------
+
+template<typename RandomIterator, typename Result, typename BinaryOp>
+Result parallel_fold_balanced(RandomIterator first, RandomIterator last, Result init, BinaryOp op,
+                              std::size_t thread_count = details::default_thread_count())
+{
+   using leaves = details::balanced_leaves<RandomIterator, Result, BinaryOp>;
+   const std::size_t BlockBits = 12;
+   const std::size_t BlockSize = 1 << BlockBits;
+
+   auto fold_leaves = [&op](RandomIterator leaf, RandomIterator end, BalancedAccumulator<BinaryOp, Result>& accOp) {
+      for (; std::size_t(end - leaf) >= leaves::Size; leaf += leaves::Size)
+         accOp(leaves::reduce(leaf, op));
+      return leaf;
+   };
+
+   std::size_t block_count = (last - first) / BlockSize;
+   std::vector<std::optional<Result>> blocks(block_count);
+   details::parallel_for(block_count, [&](std::size_t b) {
+      BalancedAccumulator<BinaryOp, Result> accOp(op, BlockBits + 1);
+      fold_leaves(first + b * BlockSize, first + (b + 1) * BlockSize, accOp);
+      blocks[b] = accOp.finalize();
+   }, thread_count);
+
+   BalancedAccumulator<BinaryOp, Result> blocksAccOp(op, 64);
+   for (auto& block : blocks)
+      blocksAccOp(std::move(*block));
+
+   BalancedAccumulator<BinaryOp, Result> tailAccOp(op, BlockBits + 1);
+   BalancedAccumulator<BinaryOp, Result> restAccOp(op, leaves::Bits + 1);
+   std::for_each(fold_leaves(first + block_count * BlockSize, last, tailAccOp), last, std::ref(restAccOp));
+   return restAccOp.finalize(tailAccOp.finalize(blocksAccOp.finalize(init)));
+}
+
+template<typename Container, typename Result, typename BinaryOp>
+Result parallel_fold_balanced(Container const& container, Result init, BinaryOp op,
+                              std::size_t thread_count = details::default_thread_count())
+{
+   return parallel_fold_balanced(begin(container), end(container), init, op, thread_count);
+}
+
+
+//-----------------------------------------------------------------------------
+// Balanced scans: inclusive and exclusive prefix folds
+// - Each prefix is the balanced fold of the elements before it: the partial
+//   results of a BalancedAccumulator fed with these elements, combined in the
+//   same order (after 'init' if any)
+// - The range is scanned by blocks of 2^12 elements, copied to a buffer and
+//   scanned in two sweeps, each block starting from the balanced fold of the
+//   totals of the blocks before it
+// - The parallel versions compute the totals of the full blocks in a first
+//   pass, then scan the blocks concurrently: their results are bit-identical
+//   to the ones of the sequential versions, whatever the number of threads
+// - The output may be the input range itself
+//-----------------------------------------------------------------------------
+
+namespace details
+{
+   const std::size_t ScanBlockSize = std::size_t(1) << 12;
+
+   template<typename BinaryOp, typename Result>
+   std::optional<Result> fold_offset(BalancedAccumulator<BinaryOp, Result>& blocksAccOp, std::optional<Result> const& init)
+   {
+      return init ? blocksAccOp.finalize(*init) : blocksAccOp.finalize();
+   }
+
+   /** Complete the scan of an up-swept block, given the prefixes before and after it (for full blocks) */
+   template<typename Result, typename BinaryOp, typename OutputIterator>
+   OutputIterator write_scan_block(std::vector<Result>& values, std::optional<Result> const& offset, std::optional<Result> const& next_offset,
+                                   bool exclusive, BinaryOp& op, OutputIterator out)
+   {
+      balanced_down_sweep(values, offset, op);
+      if (next_offset)
+         values.back() = *next_offset;
+
+      if (!exclusive)
+         return std::move(values.begin(), values.end(), out);
+
+      *out++ = *offset;
+      return std::move(values.begin(), std::prev(values.end()), out);
+   }
+
+   template<typename InputIterator, typename OutputIterator, typename Result, typename BinaryOp>
+   OutputIterator balanced_scan(InputIterator first, InputIterator last, OutputIterator out, std::optional<Result> const& init, BinaryOp op, bool exclusive)
+   {
+      BalancedAccumulator<BinaryOp, Result> blocksAccOp(op, 64);
+      std::optional<Result> offset = init;
+      std::vector<Result> values;
+      values.reserve(ScanBlockSize);
+      while (first != last)
+      {
+         values.clear();
+         for (; first != last && values.size() < ScanBlockSize; ++first)
+            values.emplace_back(*first);
+
+         balanced_up_sweep(values, op);
+         std::optional<Result> next_offset;
+         if (values.size() == ScanBlockSize)
+         {
+            blocksAccOp(values.back());
+            next_offset = fold_offset(blocksAccOp, init);
+         }
+         out = write_scan_block(values, offset, next_offset, exclusive, op, out);
+         offset = std::move(next_offset);
+      }
+      return out;
+   }
+
+   template<typename RandomIterator, typename OutputIterator, typename Result, typename BinaryOp>
+   OutputIterator parallel_balanced_scan(RandomIterator first, RandomIterator last, OutputIterator out, std::optional<Result> const& init, BinaryOp op, bool exclusive,
+                                         std::size_t thread_count)
+   {
+      if (thread_count <= 1)
+         return balanced_scan(first, last, out, init, op, exclusive);
+
+      std::size_t size = last - first;
+      std::size_t full_count = size / ScanBlockSize;
+      std::size_t block_count = (size + ScanBlockSize - 1) / ScanBlockSize;
+
+      // The prefixes before each block: the totals of the full blocks are folded by a sequential accumulator
+      std::vector<std::optional<Result>> offsets(block_count + 1);
+      parallel_for(full_count, [&](std::size_t b) {
+         std::vector<Result> values(first + b * ScanBlockSize, first + (b + 1) * ScanBlockSize);
+         balanced_up_sweep(values, op);
+         offsets[b + 1] = std::move(values.back());
+      }, thread_count);
+
+      offsets[0] = init;
+      BalancedAccumulator<BinaryOp, Result> blocksAccOp(op, 64);
+      for (std::size_t b = 0; b < full_count; ++b)
+      {
+         blocksAccOp(std::move(*offsets[b + 1]));
+         offsets[b + 1] = fold_offset(blocksAccOp, init);
+      }
+
+      parallel_for(block_count, [&](std::size_t b) {
+         std::vector<Result> values(first + b * ScanBlockSize, first + std::min(size, (b + 1) * ScanBlockSize));
+         balanced_up_sweep(values, op);
+         write_scan_block(values, offsets[b], offsets[b + 1], exclusive, op, out + b * ScanBlockSize);
+      }, thread_count);
+      return out + size;
+   }
+}
+
+template<typename InputIterator, typename OutputIterator, typename BinaryOp>
+OutputIterator inclusive_scan_balanced(InputIterator first, InputIterator last, OutputIterator out, BinaryOp op)
+{
+   using Result = typename std::iterator_traits<InputIterator>::value_type;
+   return details::balanced_scan(first, last, out, std::optional<Result>(), op, false);
+}
+
+template<typename InputIterator, typename OutputIterator, typename Result, typename BinaryOp>
+OutputIterator inclusive_scan_balanced(InputIterator first, InputIterator last, OutputIterator out, Result init, BinaryOp op)
+{
+   return details::balanced_scan(first, last, out, std::optional<Result>(std::move(init)), op, false);
+}
+
+template<typename InputIterator, typename OutputIterator, typename Result, typename BinaryOp>
+OutputIterator exclusive_scan_balanced(InputIterator first, InputIterator last, OutputIterator out, Result init, BinaryOp op)
+{
+   return details::balanced_scan(first, last, out, std::optional<Result>(std::move(init)), op, true);
+}
+
+template<typename RandomIterator, typename OutputIterator, typename BinaryOp>
+OutputIterator parallel_inclusive_scan_balanced(RandomIterator first, RandomIterator last, OutputIterator out, BinaryOp op,
+                                                std::size_t thread_count = details::default_thread_count())
+{
+   using Result = typename std::iterator_traits<RandomIterator>::value_type;
+   return details::parallel_balanced_scan(first, last, out, std::optional<Result>(), op, false, thread_count);
+}
+
+template<typename RandomIterator, typename OutputIterator, typename Result, typename BinaryOp,
+         typename = std::enable_if_t<std::is_invocable<BinaryOp&, Result const&, Result const&>::value>>
+OutputIterator parallel_inclusive_scan_balanced(RandomIterator first, RandomIterator last, OutputIterator out, Result init, BinaryOp op,
+                                                std::size_t thread_count = details::default_thread_count())
+{
+   return details::parallel_balanced_scan(first, last, out, std::optional<Result>(std::move(init)), op, false, thread_count);
+}
+
+template<typename RandomIterator, typename OutputIterator, typename Result, typename BinaryOp>
+OutputIterator parallel_exclusive_scan_balanced(RandomIterator first, RandomIterator last, OutputIterator out, Result init, BinaryOp op,
+                                                std::size_t thread_count = details::default_thread_count())
+{
+   return details::parallel_balanced_scan(first, last, out, std::optional<Result>(std::move(init)), op, true, thread_count);
+}
+
 #endif
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <hamt.hpp>
+#include <internal/mapped_file.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+
+/**
+ * A read-only hash array mapped trie, stored as a flat image without pointers
+ *
+ * 'write' serializes a trie into a file where each node lies at some offset
+ * and refers to its sub-nodes by offset. Opening the file maps it in memory:
+ * lookups run directly on the mapped pages, without any deserialization,
+ * and the pages are shared by all the processes opening the same file.
+ *
+ * Keys and values are stored as raw bytes, so they must be trivially
+ * copyable, and the hasher must give the same hashes in the process writing
+ * the file and in the processes reading it.
+ */
+template<
+   typename key_type,
+   typename value_type,
+   typename hasher = std::hash<key_type>,
+   typename key_equal = std::equal_to<key_type>
+>
+class frozen_hash_array_mapped_trie
+{
+public:
+   using trie_type = hash_array_mapped_trie<key_type, value_type, hasher, key_equal>;
+
+private:
+   using flags = std::uint32_t;
+
+   static_assert(std::is_trivially_copyable<key_type>::value, "Keys are stored as raw bytes");
+   static_assert(std::is_trivially_copyable<value_type>::value, "Values are stored as raw bytes");
+
+   static constexpr char Magic[8] = { 'H', 'A', 'M', 'T', 'F', 'R', 'Z', '\0' };
+   static constexpr std::uint32_t Version = 1;
+   static constexpr std::uint32_t ByteOrder = 0x01020304;
+
+   struct header
+   {
+      char          m_magic[8];
+      std::uint32_t m_version;
+      std::uint32_t m_byte_order;
+      std::uint32_t m_hash_bits;
+      std::uint32_t m_leaf_size;
+      std::uint64_t m_size;
+      std::uint64_t m_root;
+   };
+
+   struct frozen_node
+   {
+      flags         m_leaf_flags;
+      flags         m_flags;
+      std::uint32_t m_leaf_count;
+      std::uint32_t m_unused;
+   };
+
+   struct frozen_leaf
+   {
+      std::size_t m_hash;
+      key_type    m_key;
+      value_type  m_value;
+   };
+
+   static constexpr std::size_t round_up(std::size_t size, std::size_t alignment)
+   {
+      return (size + alignment - 1) / alignment * alignment;
+   }
+
+   static constexpr std::size_t NodeAlignment = std::max(alignof(frozen_leaf), alignof(std::uint64_t));
+   static constexpr std::size_t LeavesOffset = round_up(sizeof(frozen_node), alignof(frozen_leaf));
+
+   static std::size_t childs_offset(std::size_t leaf_count)
+   {
+      return round_up(LeavesOffset + leaf_count * sizeof(frozen_leaf), alignof(std::uint64_t));
+   }
+
+   template<typename H, typename E>
+   using if_transparent = std::void_t<typename H::is_transparent, typename E::is_transparent>;
+
+public:
+   static void write(trie_type const& trie, std::string const& path)
+   {
+      std::ofstream out(path, std::ios::binary | std::ios::trunc);
+      if (!out)
+         throw std::runtime_error("Cannot create " + path);
+
+      image_writer image { out, 0 };
+      header head = {};
+      image.write(&head, sizeof(head));
+
+      std::copy(std::begin(Magic), std::end(Magic), head.m_magic);
+      head.m_version = Version;
+      head.m_byte_order = ByteOrder;
+      head.m_hash_bits = static_cast<std::uint32_t>(trie_type::HashSize);
+      head.m_leaf_size = static_cast<std::uint32_t>(sizeof(frozen_leaf));
+      head.m_size = trie.size();
+      head.m_root = write_node(image, trie.m_root);
+
+      out.seekp(0);
+      out.write(reinterpret_cast<char const*>(&head), sizeof(head));
+      if (!out.flush())
+         throw std::runtime_error("Cannot write " + path);
+   }
+
+   explicit frozen_hash_array_mapped_trie(std::string const& path, hasher const& h = hasher(), key_equal const& eq = key_equal())
+      : m_hasher(h), m_equal(eq), m_file(path), m_header(reinterpret_cast<header const*>(m_file.data()))
+   {
+      if (m_file.size() < sizeof(header)
+         || !std::equal(std::begin(Magic), std::end(Magic), m_header->m_magic)
+         || m_header->m_version != Version
+         || m_header->m_byte_order != ByteOrder
+         || m_header->m_hash_bits != trie_type::HashSize
+         || m_header->m_leaf_size != sizeof(frozen_leaf)
+         || m_header->m_root + sizeof(frozen_node) > m_file.size())
+         throw std::runtime_error("Incompatible frozen trie " + path);
+   }
+
+   value_type const* find(key_type const& key) const
+   {
+      return find(key, m_hasher(key));
+   }
+
+   template<typename K, typename H = hasher, typename E = key_equal, typename = if_transparent<H, E>>
+   value_type const* find(K const& key) const
+   {
+      return find(key, m_hasher(key));
+   }
+
+   std::size_t count(key_type const& key) const
+   {
+      return find(key) ? 1 : 0;
+   }
+
+   template<typename K, typename H = hasher, typename E = key_equal, typename = if_transparent<H, E>>
+   std::size_t count(K const& key) const
+   {
+      return find(key) ? 1 : 0;
+   }
+
+   std::size_t size() const
+   {
+      return static_cast<std::size_t>(m_header->m_size);
+   }
+
+   bool empty() const
+   {
+      return 0 == size();
+   }
+
+private:
+   hasher               m_hasher;
+   key_equal            m_equal;
+   details::mapped_file m_file;
+   header const*        m_header;
+
+   template<typename K>
+   value_type const* find(K const& k, std::size_t h) const
+   {
+      frozen_node const* current = node_at(m_header->m_root);
+      std::size_t shifted = h;
+      for (size_t i = 0; i < trie_type::MaxDepth; ++i, shifted = shifted >> trie_type::BitCount)
+      {
+         flags bit = trie_type::bit_of(shifted);
+         if (current->m_leaf_flags & bit)
+         {
+            frozen_leaf const& l = leaves(current)[trie_type::index_of(current->m_leaf_flags, bit)];
+            return matches(l, h, k) ? &l.m_value : nullptr;
+         }
+
+         if (!(current->m_flags & bit))
+            return nullptr;
+
+         current = node_at(childs(current)[trie_type::index_of(current->m_flags, bit)]);
+      }
+
+      frozen_leaf const* first = leaves(current);
+      frozen_leaf const* last = first + current->m_leaf_count;
+      frozen_leaf const* it = std::find_if(first, last, [&](frozen_leaf const& l) { return matches(l, h, k); });
+      return it == last ? nullptr : &it->m_value;
+   }
+
+   template<typename K>
+   bool matches(frozen_leaf const& l, std::size_t h, K const& k) const
+   {
+      return l.m_hash == h && m_equal(l.m_key, k);
+   }
+
+   frozen_node const* node_at(std::uint64_t offset) const
+   {
+      return reinterpret_cast<frozen_node const*>(m_file.data() + offset);
+   }
+
+   static frozen_leaf const* leaves(frozen_node const* n)
+   {
+      return reinterpret_cast<frozen_leaf const*>(reinterpret_cast<char const*>(n) + LeavesOffset);
+   }
+
+   static std::uint64_t const* childs(frozen_node const* n)
+   {
+      return reinterpret_cast<std::uint64_t const*>(reinterpret_cast<char const*>(n) + childs_offset(n->m_leaf_count));
+   }
+
+   //--------------------------------------------------------------------------
+   // Serialization: sub-nodes are written before their parent, so that the
+   // offsets of the sub-nodes are known when writing the parent
+   //--------------------------------------------------------------------------
+
+   struct image_writer
+   {
+      std::ostream& m_out;
+      std::uint64_t m_offset;
+
+      void write(void const* data, std::size_t size)
+      {
+         m_out.write(static_cast<char const*>(data), size);
+         m_offset += size;
+      }
+
+      void align(std::size_t alignment)
+      {
+         static const char zeros[64] = {};
+         std::size_t padding = round_up(m_offset, alignment) - m_offset;
+         write(zeros, padding);
+      }
+   };
+
+   static std::uint64_t write_node(image_writer& image, typename trie_type::node const* n)
+   {
+      std::size_t child_count = trie_type::popcount(n->m_flags);
+      std::array<std::uint64_t, trie_type::FlagSize> child_offsets;
+      for (std::size_t i = 0; i < child_count; ++i)
+         child_offsets[i] = write_node(image, trie_type::childs(n)[i]);
+
+      image.align(NodeAlignment);
+      std::uint64_t offset = image.m_offset;
+      frozen_node frozen = { n->m_leaf_flags, n->m_flags, n->m_leaf_count, 0 };
+      image.write(&frozen, sizeof(frozen));
+
+      image.align(alignof(frozen_leaf));
+      for (std::size_t i = 0; i < n->m_leaf_count; ++i)
+      {
+         auto const& l = trie_type::leaves(n)[i];
+         //Zeroed buffer: deterministic padding bytes, and no default construction of keys and values
+         alignas(frozen_leaf) char out[sizeof(frozen_leaf)] = {};
+         std::memcpy(out + offsetof(frozen_leaf, m_hash), &l.m_hash, sizeof(l.m_hash));
+         std::memcpy(out + offsetof(frozen_leaf, m_key), &l.m_entry.first, sizeof(key_type));
+         std::memcpy(out + offsetof(frozen_leaf, m_value), &l.m_entry.second, sizeof(value_type));
+         image.write(out, sizeof(out));
+      }
+
+      image.align(alignof(std::uint64_t));
+      image.write(child_offsets.data(), child_count * sizeof(std::uint64_t));
+      return offset;
+   }
+};
@@ -1,20 +1,71 @@
 #pragma once
 
+#include <internal/node_pool.hpp>
+#include <internal/statistics.hpp>
+
 #include <algorithm>
-#include <bitset>
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <new>
+#include <numeric>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+
+namespace details
+{
+   template<typename Trie>
+   class hamt_const_iterator;
+}
+
+template<typename, typename, typename, typename>
+class frozen_hash_array_mapped_trie;
+
 
 /**
  * An attempt at implementing a hash array map trie
+ *
+ * Keys are stored as inline leaves at the shallowest level where their hash
+ * prefix is unique, and are only pushed down one level when another key
+ * collides on the same slot. Keys whose full hashes collide end up in a
+ * bucket at the maximal depth.
+ *
+ * Nodes are shared between copies of the trie: copying a trie is O(1) and
+ * the copy is an immutable snapshot of the original. A non-const trie acts
+ * as a transient: it updates in place the nodes it owns alone and copies the
+ * path to the nodes it shares with other versions, so each update costs
+ * O(log n) whatever the number of live versions. The const member 'with'
+ * provides the persistent interface, returning an updated version.
+ *
+ * Each node is a single exactly-sized block: a small header with the two
+ * 32 bits maps of its slots, followed by its leaves and then by the pointers
+ * to its sub-nodes, both indexed by population count. The blocks come from
+ * a pool shared by all the versions derived from the same trie.
+ *
+ * Iteration visits the entries in trie order (by slot, lowest hash digits
+ * first) and iterators are invalidated by any update of the trie.
+ *
+ * Each leaf caches the full hash of its key, compared before the keys. When
+ * both the hasher and the key equality define 'is_transparent', 'find' and
+ * 'count' accept any key type they support (such as std::string_view for
+ * std::string keys) without building a temporary key.
  */
 template<
    typename key_type,
-   typename value_type
+   typename value_type,
+   typename hasher = std::hash<key_type>,
+   typename key_equal = std::equal_to<key_type>
 >
 class hash_array_mapped_trie
 {
@@ -25,39 +76,143 @@ private:
    static constexpr std::size_t HashSize = sizeof(std::size_t) * 8;
    static constexpr std::size_t MaxDepth = HashSize / BitCount + (HashSize % BitCount ? 1 : 0);
 
-   using leaf = std::pair<key_type, value_type>;
+   using entry = std::pair<key_type, value_type>;
+   using flags = std::uint32_t;
+   using pool = details::node_pool<>;
+
+   static_assert(FlagSize == sizeof(flags) * 8, "One bit per slot");
+   struct leaf
+   {
+      leaf(std::size_t h, entry e) : m_hash(h), m_entry(std::move(e)) {}
+      std::size_t m_hash;
+      entry       m_entry;
+   };
 
    struct node
    {
-      node() : m_flags(0), m_childs(), m_size(0), m_leaves() {}
-      std::bitset<FlagSize> m_flags;
-      std::vector<node>     m_childs;
-      std::size_t           m_size;
-      std::vector<leaf>     m_leaves;
+      node(flags leaf_flags, flags child_flags, std::uint32_t leaf_count)
+         : m_refs(1), m_leaf_flags(leaf_flags), m_flags(child_flags), m_leaf_count(leaf_count) {}
+      std::atomic<std::uint32_t> m_refs;
+      flags                      m_leaf_flags; //Slots holding an inline leaf
+      flags                      m_flags;      //Slots holding a sub-node
+      std::uint32_t              m_leaf_count; //Also the size of the collision buckets
    };
 
+   static_assert(alignof(leaf) <= pool::Granularity, "Over-aligned leaves are not supported");
+
+   template<typename H, typename E>
+   using if_transparent = std::void_t<typename H::is_transparent, typename E::is_transparent>;
+
+   friend class details::hamt_const_iterator<hash_array_mapped_trie>;
+   friend class frozen_hash_array_mapped_trie<key_type, value_type, hasher, key_equal>;
+
 public:
-   hash_array_mapped_trie() = default;
-   ~hash_array_mapped_trie() = default;
+   using const_iterator = details::hamt_const_iterator<hash_array_mapped_trie>;
+
+   explicit hash_array_mapped_trie(hasher const& h = hasher(), key_equal const& eq = key_equal())
+      : m_hasher(h), m_equal(eq), m_pool(std::make_shared<pool>()), m_root(allocate_node(0, 0, 0)), m_size(0)
+   {}
+
+   template<typename InputIt>
+   hash_array_mapped_trie(InputIt first, InputIt last, hasher const& h = hasher(), key_equal const& eq = key_equal())
+      : m_hasher(h), m_equal(eq), m_pool(std::make_shared<pool>()), m_root(nullptr), m_size(0)
+   {
+      build(first, last);
+   }
+
+   hash_array_mapped_trie(std::initializer_list<entry> pairs, hasher const& h = hasher(), key_equal const& eq = key_equal())
+      : hash_array_mapped_trie(pairs.begin(), pairs.end(), h, eq)
+   {}
+
+   ~hash_array_mapped_trie()
+   {
+      release(m_root);
+   }
+
+   hash_array_mapped_trie(hash_array_mapped_trie const& other)
+      : m_hasher(other.m_hasher), m_equal(other.m_equal), m_pool(other.m_pool), m_root(other.m_root), m_size(other.m_size)
+   {
+      acquire(m_root);
+   }
+
+   hash_array_mapped_trie& operator=(hash_array_mapped_trie const& other)
+   {
+      hash_array_mapped_trie copy(other);
+      std::swap(m_hasher, copy.m_hasher);
+      std::swap(m_equal, copy.m_equal);
+      std::swap(m_pool, copy.m_pool);
+      std::swap(m_root, copy.m_root);
+      std::swap(m_size, copy.m_size);
+      return *this;
+   }
+
+   bool insert(entry const& pair)
+   {
+      bool added = insert_rec(m_root, leaf(hash_of(pair.first), pair), MaxDepth);
+      if (added) m_size++;
+      return added;
+   }
 
-   bool insert(std::pair<key_type, value_type> const& pair)
+   hash_array_mapped_trie with(entry const& pair) const
    {
-      return insert(pair.first, pair.second, std::hash<key_type>()(pair.first));
+      hash_array_mapped_trie out(*this);
+      out.insert(pair);
+      return out;
    }
 
-   std::pair<bool, value_type> find(key_type const& key) const
+   std::size_t erase(key_type const& key)
    {
-      return find(key, std::hash<key_type>()(key));
+      std::size_t h = hash_of(key);
+      if (!find(key, h))
+         return 0;
+
+      erase_rec(m_root, key, h, MaxDepth);
+      m_size--;
+      return 1;
+   }
+
+   hash_array_mapped_trie without(key_type const& key) const
+   {
+      hash_array_mapped_trie out(*this);
+      out.erase(key);
+      return out;
+   }
+
+   value_type const* find(key_type const& key) const
+   {
+      return find(key, hash_of(key));
+   }
+
+   template<typename K, typename H = hasher, typename E = key_equal, typename = if_transparent<H, E>>
+   value_type const* find(K const& key) const
+   {
+      return find(key, hash_of(key));
+   }
+
+   const_iterator begin() const
+   {
+      return const_iterator(m_root);
+   }
+
+   const_iterator end() const
+   {
+      return const_iterator();
    }
 
    std::size_t size() const
    {
-      return m_root.m_size;
+      return m_size;
    }
 
    std::size_t count(key_type const& key) const
    {
-      return find(key).first ? 1 : 0;
+      return find(key) ? 1 : 0;
+   }
+
+   template<typename K, typename H = hasher, typename E = key_equal, typename = if_transparent<H, E>>
+   std::size_t count(K const& key) const
+   {
+      return find(key) ? 1 : 0;
    }
 
    bool empty() const
@@ -65,85 +220,655 @@ public:
       return 0 == size();
    }
 
+   /**
+    * Shape and memory footprint of one or several versions of a trie. The
+    * bytes are those of the node blocks, without the memory owned by the
+    * keys and the values themselves.
+    */
+   struct statistics
+   {
+      std::vector<std::size_t> m_nodes_by_depth;   //Nodes at each depth (0 for the root)
+      std::vector<std::size_t> m_entries_by_depth; //Entries stored at each depth
+      std::vector<std::size_t> m_bucket_sizes;     //Number of collision buckets holding [i] entries
+      std::size_t              m_nodes = 0;
+      std::size_t              m_slots = 0;        //Slots used by the leaves and sub-nodes of the nodes
+      std::size_t              m_bytes = 0;
+      std::size_t              m_unique_bytes = 0; //Bytes released if these versions were dropped
+      std::size_t              m_shared_bytes = 0; //Bytes shared with other versions
+
+      double average_fan_out() const
+      {
+         return m_nodes ? static_cast<double>(m_slots) / m_nodes : 0.;
+      }
+   };
+
+   statistics stats() const
+   {
+      return stats(this, this + 1);
+   }
+
+   /** Statistics of the versions in [first, last), counting the nodes they share once */
+   template<typename Iterator>
+   static statistics stats(Iterator first, Iterator last)
+   {
+      statistics out;
+      details::sharing_analysis sharing;
+      for (; first != last; ++first)
+         collect_stats(first->m_root, nullptr, MaxDepth, sharing, out);
+      out.m_unique_bytes = sharing.released_bytes();
+      out.m_shared_bytes = out.m_bytes - out.m_unique_bytes;
+      return out;
+   }
+
 private:
-   node m_root;
+   hasher                m_hasher;
+   key_equal             m_equal;
+   std::shared_ptr<pool> m_pool;
+   node*                 m_root;
+   std::size_t           m_size;
+
+   template<typename K>
+   std::size_t hash_of(K const& k) const
+   {
+      return m_hasher(k);
+   }
 
-   bool insert(key_type const& k, value_type const& v, std::size_t h)
+   template<typename K>
+   bool matches(leaf const& l, std::size_t h, K const& k) const
    {
-      return insert_rec(m_root, k, v, h, MaxDepth);
+      return l.m_hash == h && m_equal(l.m_entry.first, k);
    }
 
-   static bool insert_rec(node& current, key_type const& k, value_type const& v, std::size_t h, size_t depth)
+   bool insert_rec(node*& current, leaf&& l, size_t depth)
    {
       if (0 == depth)
-         return insert_in_leaf(current, k, v);
-      
-      //if (current.m_flags.none())
-      //   return insert_compressed(current, k, v);
+         return insert_in_bucket(current, std::move(l));
 
-      std::size_t node_hash = h & BitHMask;
-      std::size_t index = index_of(current, node_hash);
-      if (!is_there(current, node_hash))
+      flags bit = bit_at(l.m_hash, depth);
+      if (current->m_flags & bit)
       {
-         current.m_flags.set(node_hash);
-         current.m_childs.insert(begin(current.m_childs) + index, node());
+         current = owned(current);
+         return insert_rec(childs(current)[index_of(current->m_flags, bit)], std::move(l), depth-1);
       }
-      bool added = insert_rec(current.m_childs[index], k, v, h >> BitCount, depth-1);
-      if (added) current.m_size++;
-      return added;
+
+      if (!(current->m_leaf_flags & bit))
+      {
+         current = insert_leaf(current, bit, std::move(l));
+         return true;
+      }
+
+      std::size_t leaf_index = index_of(current->m_leaf_flags, bit);
+      if (matches(leaves(current)[leaf_index], l.m_hash, l.m_entry.first))
+      {
+         current = owned(current);
+         leaves(current)[leaf_index].m_entry.second = std::move(l.m_entry.second);
+         return false;
+      }
+
+      //Collision on the slot: push both keys down in a new sub-node
+      leaf& existing = leaves(current)[leaf_index];
+      leaf pushed = is_owned(current) ? leaf(std::move(existing)) : leaf(existing);
+      node* child = make_node(std::move(pushed), std::move(l), depth-1);
+      current = replace_leaf_by_child(current, bit, child);
+      return true;
    }
 
-   static bool insert_in_leaf(node& current, key_type const& k, value_type const& v)
+   bool insert_in_bucket(node*& current, leaf&& l)
    {
-      auto it = find_leaf(current, k);
-      if (it != end(current.m_leaves))
+      leaf* first = leaves(current);
+      leaf* last = first + current->m_leaf_count;
+      leaf* it = find_leaf(first, last, l.m_hash, l.m_entry.first);
+      if (it != last)
       {
-         it->second = v;
+         std::size_t leaf_index = it - first;
+         current = owned(current);
+         leaves(current)[leaf_index].m_entry.second = std::move(l.m_entry.second);
          return false;
       }
-      current.m_leaves.push_back({ k, v });
-      current.m_size++;
+
+      current = insert_leaf(current, 0, std::move(l));
       return true;
    }
 
-   std::pair<bool, value_type> find(key_type const& k, std::size_t h) const
+   //--------------------------------------------------------------------------
+
+   /**
+    * Erase a key known to be in the sub-trie: a sub-node left with a single
+    * leaf is contracted, its leaf moving up to the slot of the parent
+    */
+   void erase_rec(node*& current, key_type const& k, std::size_t h, size_t depth)
+   {
+      if (0 == depth)
+      {
+         leaf* first = leaves(current);
+         std::size_t leaf_index = find_leaf(first, first + current->m_leaf_count, h, k) - first;
+         current = remove_leaf(current, 0, leaf_index);
+         return;
+      }
+
+      flags bit = bit_at(h, depth);
+      if (current->m_leaf_flags & bit)
+      {
+         current = remove_leaf(current, bit, index_of(current->m_leaf_flags, bit));
+         return;
+      }
+
+      current = owned(current);
+      node*& child = childs(current)[index_of(current->m_flags, bit)];
+      erase_rec(child, k, h, depth-1);
+      if (1 == child->m_leaf_count && 0 == child->m_flags)
+      {
+         leaf pulled = is_owned(child) ? leaf(std::move(leaves(child)[0])) : leaf(leaves(child)[0]);
+         current = replace_child_by_leaf(current, bit, std::move(pulled));
+      }
+   }
+
+   //--------------------------------------------------------------------------
+
+   /**
+    * Bulk load: at each level, the entries of a node are partitioned by slot
+    * with a stable counting pass on their hash digit, ping-ponging between
+    * two buffers, and each node is built once, bottom-up, with its final size
+    */
+   struct bulk_entry
+   {
+      std::size_t m_hash;
+      std::size_t m_index;
+   };
+
+   using bulk_iterator = typename std::vector<bulk_entry>::iterator;
+
+   template<typename InputIt>
+   void build(InputIt first, InputIt last)
+   {
+      std::vector<entry> values(first, last);
+      std::vector<bulk_entry> entries(values.size());
+      for (std::size_t i = 0; i < values.size(); ++i)
+         entries[i] = { hash_of(values[i].first), i };
+
+      std::vector<bulk_entry> scratch(entries.size());
+      m_root = build_node(entries.begin(), entries.end(), scratch.begin(), values, MaxDepth);
+   }
+
+   node* build_node(bulk_iterator first, bulk_iterator last, bulk_iterator scratch, std::vector<entry>& values, size_t depth)
+   {
+      if (0 == depth)
+      {
+         std::vector<std::size_t> kept = distinct_keys(first, last, values);
+         node* out = allocate_node(0, 0, kept.size());
+         for (std::size_t i = 0; i < kept.size(); ++i)
+            new (leaves(out) + i) leaf(first->m_hash, std::move(values[kept[i]]));
+         m_size += kept.size();
+         return out;
+      }
+
+      std::size_t shift = BitCount * (MaxDepth - depth);
+      auto slot_of = [shift](bulk_entry const& e) { return (e.m_hash >> shift) & BitHMask; };
+
+      std::array<std::size_t, FlagSize + 1> starts = {};
+      std::for_each(first, last, [&](bulk_entry const& e) { starts[1 + slot_of(e)]++; });
+      std::partial_sum(starts.begin(), starts.end(), starts.begin());
+      std::array<std::size_t, FlagSize + 1> next = starts;
+      std::for_each(first, last, [&](bulk_entry const& e) { scratch[next[slot_of(e)]++] = e; });
+
+      std::array<bulk_entry, FlagSize> leaf_of;
+      std::array<node*, FlagSize> child_of;
+      flags leaf_flags = 0;
+      flags child_flags = 0;
+
+      for (std::size_t slot = 0; slot < FlagSize; ++slot)
+      {
+         bulk_iterator group = scratch + starts[slot];
+         bulk_iterator group_end = scratch + starts[slot + 1];
+         if (group == group_end)
+            continue;
+
+         bool is_leaf = std::next(group) == group_end;
+         bulk_entry single = *group;
+         if (!is_leaf && std::all_of(group, group_end, [&](bulk_entry const& e) { return e.m_hash == group->m_hash; }))
+         {
+            std::vector<std::size_t> kept = distinct_keys(group, group_end, values);
+            is_leaf = 1 == kept.size();
+            single.m_index = kept.front();
+         }
+
+         if (is_leaf)
+         {
+            leaf_flags |= flags(1) << slot;
+            leaf_of[slot] = single;
+         }
+         else
+         {
+            child_flags |= flags(1) << slot;
+            child_of[slot] = build_node(group, group_end, first + starts[slot], values, depth-1);
+         }
+      }
+
+      node* out = allocate_node(leaf_flags, child_flags, popcount(leaf_flags));
+      leaf* out_leaves = leaves(out);
+      node** out_childs = childs(out);
+      for (std::size_t slot = 0; slot < FlagSize; ++slot)
+      {
+         if (leaf_flags & (flags(1) << slot))
+            new (out_leaves++) leaf(leaf_of[slot].m_hash, std::move(values[leaf_of[slot].m_index]));
+         else if (child_flags & (flags(1) << slot))
+            *out_childs++ = child_of[slot];
+      }
+      m_size += popcount(leaf_flags);
+      return out;
+   }
+
+   /**
+    * Indices of the distinct keys of entries sharing the same hash, keeping
+    * the last occurrence of each key, as successive inserts would
+    */
+   std::vector<std::size_t> distinct_keys(bulk_iterator first, bulk_iterator last, std::vector<entry> const& values) const
+   {
+      std::vector<std::size_t> kept;
+      for (bulk_iterator it = last; it != first;)
+      {
+         --it;
+         auto same_key = [&](std::size_t k) { return m_equal(values[k].first, values[it->m_index].first); };
+         if (std::none_of(kept.begin(), kept.end(), same_key))
+            kept.push_back(it->m_index);
+      }
+      return kept;
+   }
+
+   //--------------------------------------------------------------------------
+
+   node* make_node(leaf&& lhs, leaf&& rhs, size_t depth)
+   {
+      if (0 == depth)
+      {
+         node* out = allocate_node(0, 0, 2);
+         new (leaves(out)) leaf(std::move(lhs));
+         new (leaves(out) + 1) leaf(std::move(rhs));
+         return out;
+      }
+
+      flags lhs_bit = bit_at(lhs.m_hash, depth);
+      flags rhs_bit = bit_at(rhs.m_hash, depth);
+      if (lhs_bit == rhs_bit)
+      {
+         node* child = make_node(std::move(lhs), std::move(rhs), depth-1);
+         node* out = allocate_node(0, lhs_bit, 0);
+         childs(out)[0] = child;
+         return out;
+      }
+
+      node* out = allocate_node(lhs_bit | rhs_bit, 0, 2);
+      if (rhs_bit < lhs_bit)
+         std::swap(lhs, rhs);
+      new (leaves(out)) leaf(std::move(lhs));
+      new (leaves(out) + 1) leaf(std::move(rhs));
+      return out;
+   }
+
+   template<typename K>
+   value_type const* find(K const& k, std::size_t h) const
    {
-      static const std::pair<bool, value_type> NotFound(false, value_type());
-      
-      node const* current = &m_root;
-      for (size_t i = 0; i < MaxDepth; ++i, h = h >> BitCount)
+      node const* current = m_root;
+      std::size_t shifted = h;
+      for (size_t i = 0; i < MaxDepth; ++i, shifted = shifted >> BitCount)
       {
-         std::size_t node_hash = h & BitHMask;
-         if (!is_there(*current, node_hash))
-            return NotFound;
+         flags bit = bit_of(shifted);
+         if (current->m_leaf_flags & bit)
+         {
+            leaf const& l = leaves(current)[index_of(current->m_leaf_flags, bit)];
+            return matches(l, h, k) ? &l.m_entry.second : nullptr;
+         }
+
+         if (!(current->m_flags & bit))
+            return nullptr;
+
+         current = childs(current)[index_of(current->m_flags, bit)];
+      }
+
+      leaf const* first = leaves(current);
+      leaf const* last = first + current->m_leaf_count;
+      leaf const* it = find_leaf(first, last, h, k);
+      return it == last ? nullptr : &it->m_entry.second;
+   }
+
+   template<typename Leaf, typename K>
+   Leaf* find_leaf(Leaf* first, Leaf* last, std::size_t h, K const& k) const
+   {
+      return std::find_if(first, last, [&](leaf const& l) { return matches(l, h, k); });
+   }
+
+   //--------------------------------------------------------------------------
+   // Node layout
+   //--------------------------------------------------------------------------
+
+   static std::size_t popcount(flags f)
+   {
+#if defined(_MSC_VER)
+      return __popcnt(f);
+#else
+      return __builtin_popcount(f);
+#endif
+   }
+
+   static flags bit_of(std::size_t h)
+   {
+      return flags(1) << (h & BitHMask);
+   }
+
+   static flags bit_at(std::size_t h, size_t depth)
+   {
+      return bit_of(h >> (BitCount * (MaxDepth - depth)));
+   }
+
+   static std::size_t index_of(flags f, flags bit)
+   {
+      return popcount(f & (bit - 1));
+   }
+
+   static constexpr std::size_t round_up(std::size_t size, std::size_t alignment)
+   {
+      return (size + alignment - 1) / alignment * alignment;
+   }
+
+   static constexpr std::size_t LeavesOffset = round_up(sizeof(node), alignof(leaf));
+
+   static std::size_t childs_offset(std::size_t leaf_count)
+   {
+      return round_up(LeavesOffset + leaf_count * sizeof(leaf), alignof(node*));
+   }
+
+   static std::size_t size_of(node const* n)
+   {
+      return childs_offset(n->m_leaf_count) + popcount(n->m_flags) * sizeof(node*);
+   }
+
+   static leaf* leaves(node* n)
+   {
+      return reinterpret_cast<leaf*>(reinterpret_cast<char*>(n) + LeavesOffset);
+   }
+
+   static leaf const* leaves(node const* n)
+   {
+      return reinterpret_cast<leaf const*>(reinterpret_cast<char const*>(n) + LeavesOffset);
+   }
+
+   static node** childs(node* n)
+   {
+      return reinterpret_cast<node**>(reinterpret_cast<char*>(n) + childs_offset(n->m_leaf_count));
+   }
+
+   static node* const* childs(node const* n)
+   {
+      return reinterpret_cast<node* const*>(reinterpret_cast<char const*>(n) + childs_offset(n->m_leaf_count));
+   }
+
+   //--------------------------------------------------------------------------
+   // Node life cycle
+   //--------------------------------------------------------------------------
+
+   node* allocate_node(flags leaf_flags, flags child_flags, std::size_t leaf_count)
+   {
+      std::size_t size = childs_offset(leaf_count) + popcount(child_flags) * sizeof(node*);
+      return new (m_pool->allocate(size)) node(leaf_flags, child_flags, static_cast<std::uint32_t>(leaf_count));
+   }
+
+   static void acquire(node* n)
+   {
+      n->m_refs.fetch_add(1, std::memory_order_relaxed);
+   }
 
-         std::size_t index = index_of(*current, node_hash);
-         current = &(current->m_childs[index]);
+   void release(node* n)
+   {
+      if (n->m_refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+         return;
+
+      std::for_each(childs(n), childs(n) + popcount(n->m_flags), [this](node* c) { release(c); });
+      deallocate_node(n);
+   }
+
+   void deallocate_node(node* n)
+   {
+      std::size_t size = size_of(n);
+      std::for_each(leaves(n), leaves(n) + n->m_leaf_count, [](leaf& l) { l.~leaf(); });
+      n->~node();
+      m_pool->deallocate(n, size);
+   }
+
+   static void collect_stats(node const* n, node const* parent, std::size_t depth, details::sharing_analysis& sharing, statistics& out)
+   {
+      if (!sharing.add_reference(n, parent))
+         return;
+
+      std::size_t bytes = pool::block_size(size_of(n));
+      std::size_t level = MaxDepth - depth;
+      sharing.describe(n, depth, n->m_refs.load(std::memory_order_relaxed), bytes);
+      details::histogram_at(out.m_nodes_by_depth, level)++;
+      details::histogram_at(out.m_entries_by_depth, level) += n->m_leaf_count;
+      out.m_nodes++;
+      out.m_bytes += bytes;
+      if (0 == depth)
+      {
+         details::histogram_at(out.m_bucket_sizes, n->m_leaf_count)++;
+         out.m_slots += n->m_leaf_count;
+         return;
       }
 
-      auto it = find_leaf(*current, k);
-      return it == end(current->m_leaves) ? NotFound : std::make_pair(true, it->second);
+      out.m_slots += popcount(n->m_leaf_flags | n->m_flags);
+      std::for_each(childs(n), childs(n) + popcount(n->m_flags), [&](node const* c) { collect_stats(c, n, depth - 1, sharing, out); });
+   }
+
+   static bool is_owned(node const* n)
+   {
+      return n->m_refs.load(std::memory_order_acquire) == 1;
+   }
+
+   /**
+    * Copy (or move if 'from' is owned) a range of leaves or sub-nodes of
+    * a node being replaced into a new node
+    */
+   static void transfer_leaves(node* from, bool own, std::size_t first, std::size_t last, leaf* out)
+   {
+      if (own)
+         std::uninitialized_copy(std::make_move_iterator(leaves(from) + first), std::make_move_iterator(leaves(from) + last), out);
+      else
+         std::uninitialized_copy(leaves(from) + first, leaves(from) + last, out);
+   }
+
+   static void transfer_childs(node* from, bool own, std::size_t first, std::size_t last, node** out)
+   {
+      std::copy(childs(from) + first, childs(from) + last, out);
+      if (!own)
+         std::for_each(childs(from) + first, childs(from) + last, acquire);
    }
 
-   static bool is_there(node const& n, std::size_t h)
+   /**
+    * Drop the node replaced by a new node: the sub-nodes of an owned node
+    * have been transferred and its leaves moved from, so only its block goes
+    */
+   void dispose(node* n, bool own)
    {
-      return n.m_flags.test(h);
+      if (own)
+         deallocate_node(n);
+      else
+         release(n);
    }
 
-   static std::size_t index_of(node const& n, std::size_t h)
+   node* owned(node* n)
    {
-      std::size_t shift = FlagSize - h;
-      std::bitset<FlagSize> shifted = n.m_flags << shift; //And not (>>)
-      return shifted.count();
+      if (is_owned(n))
+         return n;
+
+      node* out = allocate_node(n->m_leaf_flags, n->m_flags, n->m_leaf_count);
+      transfer_leaves(n, false, 0, n->m_leaf_count, leaves(out));
+      transfer_childs(n, false, 0, popcount(n->m_flags), childs(out));
+      release(n);
+      return out;
    }
 
-   static auto find_leaf(node& n, key_type const& k)
+   /**
+    * Structural updates, each building a new exactly-sized node
+    * (a null bit adds the leaf at the end of a collision bucket)
+    */
+   node* insert_leaf(node* n, flags bit, leaf&& l)
    {
-      return find_if(begin(n.m_leaves), end(n.m_leaves), [&](auto const& p) { return p.first == k; });
+      bool own = is_owned(n);
+      std::size_t index = bit ? index_of(n->m_leaf_flags, bit) : n->m_leaf_count;
+      std::size_t child_count = popcount(n->m_flags);
+
+      node* out = allocate_node(n->m_leaf_flags | bit, n->m_flags, n->m_leaf_count + 1);
+      transfer_leaves(n, own, 0, index, leaves(out));
+      new (leaves(out) + index) leaf(std::move(l));
+      transfer_leaves(n, own, index, n->m_leaf_count, leaves(out) + index + 1);
+      transfer_childs(n, own, 0, child_count, childs(out));
+      dispose(n, own);
+      return out;
+   }
+
+   node* remove_leaf(node* n, flags bit, std::size_t index)
+   {
+      bool own = is_owned(n);
+      std::size_t child_count = popcount(n->m_flags);
+
+      node* out = allocate_node(n->m_leaf_flags & ~bit, n->m_flags, n->m_leaf_count - 1);
+      transfer_leaves(n, own, 0, index, leaves(out));
+      transfer_leaves(n, own, index + 1, n->m_leaf_count, leaves(out) + index);
+      transfer_childs(n, own, 0, child_count, childs(out));
+      dispose(n, own);
+      return out;
+   }
+
+   node* replace_child_by_leaf(node* n, flags bit, leaf&& l)
+   {
+      bool own = is_owned(n);
+      std::size_t index = index_of(n->m_leaf_flags, bit);
+      std::size_t child_index = index_of(n->m_flags, bit);
+      std::size_t child_count = popcount(n->m_flags);
+      node* child = childs(n)[child_index];
+
+      node* out = allocate_node(n->m_leaf_flags | bit, n->m_flags & ~bit, n->m_leaf_count + 1);
+      transfer_leaves(n, own, 0, index, leaves(out));
+      new (leaves(out) + index) leaf(std::move(l));
+      transfer_leaves(n, own, index, n->m_leaf_count, leaves(out) + index + 1);
+      transfer_childs(n, own, 0, child_index, childs(out));
+      transfer_childs(n, own, child_index + 1, child_count, childs(out) + child_index);
+      if (own)
+         release(child);
+      dispose(n, own);
+      return out;
    }
 
-   static auto find_leaf(node const& n, key_type const& k)
+   node* replace_leaf_by_child(node* n, flags bit, node* child)
    {
-      return find_if(begin(n.m_leaves), end(n.m_leaves), [&](auto const& p) { return p.first == k; });
+      bool own = is_owned(n);
+      std::size_t index = index_of(n->m_leaf_flags, bit);
+      std::size_t child_index = index_of(n->m_flags, bit);
+      std::size_t child_count = popcount(n->m_flags);
+
+      node* out = allocate_node(n->m_leaf_flags & ~bit, n->m_flags | bit, n->m_leaf_count - 1);
+      transfer_leaves(n, own, 0, index, leaves(out));
+      transfer_leaves(n, own, index + 1, n->m_leaf_count, leaves(out) + index);
+      transfer_childs(n, own, 0, child_index, childs(out));
+      childs(out)[child_index] = child;
+      transfer_childs(n, own, child_index, child_count, childs(out) + child_index + 1);
+      dispose(n, own);
+      return out;
    }
 };
+
+
+namespace details
+{
+   //--------------------------------------------------------------------------
+   // Forward iterator on the entries of a hash array mapped trie
+   //--------------------------------------------------------------------------
+
+   template<typename Trie>
+   class hamt_const_iterator
+   {
+   private:
+      using node = typename Trie::node;
+      using flags = typename Trie::flags;
+
+      struct frame
+      {
+         node const*   m_node;
+         std::uint32_t m_remaining; //Slots (or bucket entries) left to visit
+      };
+
+   public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = typename Trie::entry;
+      using difference_type = std::ptrdiff_t;
+      using pointer = value_type const*;
+      using reference = value_type const&;
+
+      hamt_const_iterator() : m_stack(), m_depth(0), m_current(nullptr) {}
+
+      reference operator*() const { return *m_current; }
+      pointer operator->() const { return m_current; }
+
+      hamt_const_iterator& operator++()
+      {
+         next();
+         return *this;
+      }
+
+      hamt_const_iterator operator++(int)
+      {
+         hamt_const_iterator out(*this);
+         next();
+         return out;
+      }
+
+      bool operator==(hamt_const_iterator const& other) const { return m_current == other.m_current; }
+      bool operator!=(hamt_const_iterator const& other) const { return m_current != other.m_current; }
+
+   private:
+      friend Trie;
+
+      std::array<frame, Trie::MaxDepth + 1> m_stack;
+      std::size_t                           m_depth;
+      value_type const*                     m_current;
+
+      explicit hamt_const_iterator(node const* root) : m_stack(), m_depth(0), m_current(nullptr)
+      {
+         push(root);
+         next();
+      }
+
+      void push(node const* n)
+      {
+         bool is_bucket = m_depth == Trie::MaxDepth;
+         m_stack[m_depth++] = { n, is_bucket ? n->m_leaf_count : n->m_leaf_flags | n->m_flags };
+      }
+
+      void next()
+      {
+         while (m_depth)
+         {
+            frame& top = m_stack[m_depth - 1];
+            if (!top.m_remaining)
+            {
+               --m_depth;
+            }
+            else if (m_depth - 1 == Trie::MaxDepth)
+            {
+               m_current = &Trie::leaves(top.m_node)[top.m_node->m_leaf_count - top.m_remaining--].m_entry;
+               return;
+            }
+            else
+            {
+               flags bit = top.m_remaining & (~top.m_remaining + 1);
+               top.m_remaining &= ~bit;
+               if (top.m_node->m_leaf_flags & bit)
+               {
+                  m_current = &Trie::leaves(top.m_node)[Trie::index_of(top.m_node->m_leaf_flags, bit)].m_entry;
+                  return;
+               }
+               push(Trie::childs(top.m_node)[Trie::index_of(top.m_node->m_flags, bit)]);
+            }
+         }
+         m_current = nullptr;
+      }
+   };
+}
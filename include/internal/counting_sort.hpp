@@ -0,0 +1,179 @@
+#ifndef INTERNAL_COUNTING_SORT_HPP
+#define INTERNAL_COUNTING_SORT_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+
+
+namespace details
+{
+   //--------------------------------------------------------------------------
+   // Buckets of a counting sort, for the keys in [min_key, max_key]
+   // - 'count' the keys, then 'prefix_sum' to get the start of each bucket
+   // - 'next_slot' gives the destination of the next element of a bucket, so
+   //   that the elements with the same key keep their order
+   //--------------------------------------------------------------------------
+
+   template<typename Key>
+   class key_buckets
+   {
+   public:
+      key_buckets(Key min_key, Key max_key) : m_min(min_key), m_starts(index(max_key) + 2, 0) {}
+
+      void count(Key k)
+      {
+         ++m_starts[index(k) + 1];
+      }
+
+      template<typename KeyIt>
+      void count(KeyIt first, KeyIt last)
+      {
+         for (; first != last; ++first)
+            count(*first);
+      }
+
+      void prefix_sum()
+      {
+         std::partial_sum(m_starts.begin(), m_starts.end(), m_starts.begin());
+      }
+
+      /** Prefix sum over the counts of consecutive ranges of the input: each range gets its own slots in each bucket */
+      static void prefix_sum(std::vector<key_buckets>& ranges)
+      {
+         std::size_t total = 0;
+         std::size_t bucket_count = ranges.front().m_starts.size() - 1;
+         for (std::size_t b = 0; b < bucket_count; ++b)
+         {
+            for (auto& range : ranges)
+            {
+               std::size_t count = range.m_starts[b + 1];
+               range.m_starts[b] = total;
+               total += count;
+            }
+         }
+      }
+
+      std::size_t next_slot(Key k)
+      {
+         return m_starts[index(k)]++;
+      }
+
+   private:
+      Key                      m_min;
+      std::vector<std::size_t> m_starts;
+
+      std::size_t index(Key k) const
+      {
+         return static_cast<std::size_t>(k - m_min);
+      }
+   };
+
+   /** Keys small enough to count them on their whole domain, without looking for their range first */
+   template<typename Key>
+   constexpr bool is_small_key = std::is_integral<Key>::value && sizeof(Key) <= 2;
+
+   template<typename KeyIt>
+   auto count_keys(KeyIt first, KeyIt last)
+   {
+      using key_type = typename std::iterator_traits<KeyIt>::value_type;
+      static_assert(std::is_integral<key_type>::value, "Counting sort requires integer keys");
+
+      auto range = std::minmax_element(first, last);
+      key_buckets<key_type> buckets(*range.first, *range.second);
+      buckets.count(first, last);
+      buckets.prefix_sum();
+      return buckets;
+   }
+
+   /** Project the keys in 'keys' and count them, in a single pass for small keys */
+   template<typename InputIt, typename Projection, typename Key>
+   key_buckets<Key> project_keys(InputIt first, InputIt last, Projection proj, std::vector<Key>& keys)
+   {
+      std::size_t size = std::distance(first, last);
+      keys.reserve(size);
+      if constexpr (is_small_key<Key>)
+      {
+         constexpr Key min_key = std::numeric_limits<Key>::min();
+         constexpr Key max_key = std::numeric_limits<Key>::max();
+         if (size >= std::size_t(max_key - min_key))
+         {
+            key_buckets<Key> buckets(min_key, max_key);
+            for (; first != last; ++first)
+            {
+               keys.push_back(proj(*first));
+               buckets.count(keys.back());
+            }
+            buckets.prefix_sum();
+            return buckets;
+         }
+      }
+
+      std::transform(first, last, std::back_inserter(keys), proj);
+      return count_keys(keys.begin(), keys.end());
+   }
+
+   //--------------------------------------------------------------------------
+   // Move the elements of [first, last) to their sorted position, given their
+   // keys: they are moved once to a buffer and once back in place
+   //--------------------------------------------------------------------------
+
+   template<typename RandomIt, typename KeyIt, typename Key>
+   void scatter_by_keys(RandomIt first, RandomIt last, KeyIt keys, key_buckets<Key>& buckets, std::random_access_iterator_tag)
+   {
+      using value_type = typename std::iterator_traits<RandomIt>::value_type;
+      std::vector<value_type> buffer(std::make_move_iterator(first), std::make_move_iterator(last));
+      for (auto& v : buffer)
+         first[buckets.next_slot(*keys++)] = std::move(v);
+   }
+
+   template<typename ForwardIt, typename KeyIt, typename Key>
+   void scatter_by_keys(ForwardIt first, ForwardIt last, KeyIt keys, key_buckets<Key>& buckets, std::forward_iterator_tag)
+   {
+      using value_type = typename std::iterator_traits<ForwardIt>::value_type;
+      std::vector<value_type> buffer(std::make_move_iterator(first), std::make_move_iterator(last));
+      std::vector<std::size_t> order(buffer.size());
+      for (std::size_t i = 0; i < buffer.size(); ++i)
+         order[buckets.next_slot(*keys++)] = i;
+      for (std::size_t i : order)
+         *first++ = std::move(buffer[i]);
+   }
+
+   template<typename ForwardIt, typename KeyIt, typename Key>
+   void scatter_by_keys(ForwardIt first, ForwardIt last, KeyIt keys, key_buckets<Key>& buckets)
+   {
+      scatter_by_keys(first, last, keys, buckets, typename std::iterator_traits<ForwardIt>::iterator_category());
+   }
+
+   //--------------------------------------------------------------------------
+   // Permutation of the elements in place, to move each one in its bucket
+   // (American flag sort)
+   // - 'nexts' are the next slots to fill in each bucket, 'ends' their ends
+   // - 'bucket_at(i)' is the bucket of the i-th element, 'swap_at(i, j)' swaps
+   //   two elements (and whatever is attached to them)
+   // - Each element is swapped directly to the next slot of its bucket, until
+   //   the current slot receives an element of its own bucket
+   //--------------------------------------------------------------------------
+
+   template<typename Offsets, typename BucketAt, typename SwapAt>
+   void permute_to_buckets(Offsets& nexts, Offsets const& ends, BucketAt bucket_at, SwapAt swap_at)
+   {
+      for (std::size_t b = 0; b + 1 < nexts.size(); ++b)
+      {
+         while (nexts[b] != ends[b])
+         {
+            std::size_t target = bucket_at(nexts[b]);
+            if (target == b)
+               ++nexts[b];
+            else
+               swap_at(nexts[b], nexts[target]++);
+         }
+      }
+   }
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef INTERNAL_EPOCHS_HPP
+#define INTERNAL_EPOCHS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <thread>
+
+
+namespace details
+{
+   //--------------------------------------------------------------------------
+   // Epoch based reclamation, for one writer and many lock-free readers
+   // - A reader announces the current epoch in a free slot for its read
+   // - The writer tags what it retires with the epoch, then advances it
+   // - What is retired in epoch 'e' can be destroyed once the oldest epoch
+   //   announced by the active readers is greater than 'e'
+   // - There are 'slot_count' slots (by default 64, or 4 per hardware thread
+   //   if more): beyond as many concurrent (or nested) reads, the readers
+   //   wait for a slot, yielding their thread after each pass over the slots
+   //--------------------------------------------------------------------------
+
+   class epoch_domain
+   {
+   public:
+      explicit epoch_domain(std::size_t slot_count = default_slot_count())
+         : m_epoch(1), m_slots(new slot[slot_count]), m_slot_count(slot_count)
+      {}
+
+      std::size_t enter()
+      {
+         std::size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+         for (std::size_t i = 0;; ++i)
+         {
+            std::size_t index = (start + i) % m_slot_count;
+            std::atomic<std::uint64_t>& announced = m_slots[index].m_epoch;
+            std::uint64_t free = 0;
+            if (0 == announced.load(std::memory_order_relaxed)
+               && announced.compare_exchange_strong(free, m_epoch.load()))
+               return index;
+
+            if ((i + 1) % m_slot_count == 0)
+               std::this_thread::yield();
+         }
+      }
+
+      void leave(std::size_t index)
+      {
+         m_slots[index].m_epoch.store(0, std::memory_order_release);
+      }
+
+      std::uint64_t advance()
+      {
+         return m_epoch.fetch_add(1);
+      }
+
+      std::uint64_t oldest_active() const
+      {
+         std::uint64_t oldest = std::numeric_limits<std::uint64_t>::max();
+         for (std::size_t i = 0; i < m_slot_count; ++i)
+         {
+            std::uint64_t announced = m_slots[i].m_epoch.load();
+            if (announced)
+               oldest = std::min(oldest, announced);
+         }
+         return oldest;
+      }
+
+   private:
+      struct alignas(64) slot
+      {
+         slot() : m_epoch(0) {}
+         std::atomic<std::uint64_t> m_epoch; //0 when the slot is free
+      };
+
+      std::atomic<std::uint64_t> m_epoch;
+      std::unique_ptr<slot[]>    m_slots;
+      std::size_t                m_slot_count;
+
+      static std::size_t default_slot_count()
+      {
+         return std::max<std::size_t>(64, 4 * std::thread::hardware_concurrency());
+      }
+   };
+
+   //--------------------------------------------------------------------------
+
+   class epoch_guard
+   {
+   public:
+      explicit epoch_guard(epoch_domain& domain) : m_domain(domain), m_slot(domain.enter()) {}
+      ~epoch_guard() { m_domain.leave(m_slot); }
+      epoch_guard(epoch_guard const&) = delete;
+      epoch_guard& operator=(epoch_guard const&) = delete;
+
+   private:
+      epoch_domain& m_domain;
+      std::size_t   m_slot;
+   };
+}
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef INTERNAL_FILTERING_HPP
+#define INTERNAL_FILTERING_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FILTERING_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+namespace details
+{
+   //--------------------------------------------------------------------------
+   // Stream compaction of contiguous arrays of small trivially copyable types
+   // - The predicate is evaluated on a whole block of lanes into a bit mask,
+   //   then the selected lanes are packed with a single shuffle and stored
+   // - The implementation is chosen at runtime: AVX-512, AVX2, or a scalar
+   //   loop without branches
+   // - The predicate is called once per element, in order, on the element in
+   //   place (as a mutable lvalue), as in the generic loop
+   //--------------------------------------------------------------------------
+
+   template<typename T>
+   constexpr bool is_compactable = std::is_trivially_copyable<T>::value && (sizeof(T) == 4 || sizeof(T) == 8);
+
+   template<typename It>
+   constexpr bool is_contiguous_iterator =
+      std::is_pointer<It>::value
+      || std::is_same<It, typename std::vector<typename std::iterator_traits<It>::value_type>::iterator>::value;
+
+   template<typename It>
+   constexpr bool is_compactable_range =
+      is_compactable<typename std::iterator_traits<It>::value_type> && is_contiguous_iterator<It>;
+
+   /** Copy every element to the output, but only move the output past the selected ones */
+   template<typename T, typename Predicate>
+   T* compact_scalar(T* first, T* last, T* out, Predicate& pred)
+   {
+      for (; first != last; ++first)
+      {
+         bool selected = pred(*first);
+         *out = *first;
+         out += selected ? 1 : 0;
+      }
+      return out;
+   }
+
+#ifdef FILTERING_X86_SIMD
+
+   template<std::size_t Lanes, typename T, typename Predicate>
+   inline unsigned selection_mask(T* values, Predicate& pred)
+   {
+      unsigned mask = 0;
+      for (std::size_t i = 0; i < Lanes; ++i)
+         mask |= unsigned(pred(values[i]) ? 1 : 0) << i;
+      return mask;
+   }
+
+   /** For each selection mask of 'Lanes' lanes, the 32 bits words that pack the selected lanes in a 256 bits register */
+   template<std::size_t Lanes>
+   std::array<std::array<std::uint32_t, 8>, 1 << Lanes> const& compaction_table()
+   {
+      static const auto table = []
+      {
+         const std::size_t Words = 8 / Lanes;
+         std::array<std::array<std::uint32_t, 8>, 1 << Lanes> indices {};
+         for (std::size_t mask = 0; mask < indices.size(); ++mask)
+         {
+            std::size_t out = 0;
+            for (std::size_t lane = 0; lane < Lanes; ++lane)
+            {
+               if (mask & (1 << lane))
+               {
+                  for (std::size_t w = 0; w < Words; ++w)
+                     indices[mask][out++] = static_cast<std::uint32_t>(lane * Words + w);
+               }
+            }
+         }
+         return indices;
+      }();
+      return table;
+   }
+
+   /** The stores write a whole register at the output, which never goes past the block just read */
+   template<typename T, typename Predicate>
+   __attribute__((target("avx2,popcnt")))
+   T* compact_avx2(T* first, T* last, T* out, Predicate& pred)
+   {
+      const std::size_t Lanes = 32 / sizeof(T);
+      auto const& table = compaction_table<Lanes>();
+      for (; std::size_t(last - first) >= Lanes; first += Lanes)
+      {
+         unsigned mask = selection_mask<Lanes>(first, pred);
+         __m256i values = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(first));
+         __m256i indices = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(table[mask].data()));
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_permutevar8x32_epi32(values, indices));
+         out += __builtin_popcount(mask);
+      }
+      return compact_scalar(first, last, out, pred);
+   }
+
+   template<typename T, typename Predicate>
+   __attribute__((target("avx512f,popcnt")))
+   T* compact_avx512(T* first, T* last, T* out, Predicate& pred)
+   {
+      const std::size_t Lanes = 64 / sizeof(T);
+      for (; std::size_t(last - first) >= Lanes; first += Lanes)
+      {
+         unsigned mask = selection_mask<Lanes>(first, pred);
+         __m512i values = _mm512_loadu_si512(first);
+         if constexpr (sizeof(T) == 4)
+            _mm512_storeu_si512(out, _mm512_maskz_compress_epi32(static_cast<__mmask16>(mask), values));
+         else
+            _mm512_storeu_si512(out, _mm512_maskz_compress_epi64(static_cast<__mmask8>(mask), values));
+         out += __builtin_popcount(mask);
+      }
+      return compact_scalar(first, last, out, pred);
+   }
+
+#endif
+
+   /** Keep the elements of [first, last) satisfying the predicate, in order, and return their new end */
+   template<typename T, typename Predicate>
+   T* compact(T* first, T* last, Predicate& pred)
+   {
+#ifdef FILTERING_X86_SIMD
+      if (__builtin_cpu_supports("avx512f"))
+         return compact_avx512(first, last, first, pred);
+      if (__builtin_cpu_supports("avx2"))
+         return compact_avx2(first, last, first, pred);
+#endif
+      return compact_scalar(first, last, first, pred);
+   }
+
+   template<typename It, typename Predicate>
+   It compact_range(It first, It last, Predicate& pred)
+   {
+      if (first == last)
+         return first;
+
+      auto data = std::addressof(*first);
+      return first + (compact(data, data + (last - first), pred) - data);
+   }
+}
+
+#endif
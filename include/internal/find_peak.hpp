@@ -0,0 +1,59 @@
+#ifndef INTERNAL_FIND_PEAK_HPP
+#define INTERNAL_FIND_PEAK_HPP
+
+#include <cstddef>
+#include <iterator>
+
+
+namespace details
+{
+   //--------------------------------------------------------------------------
+   // Search of a peak in [m_first, m_first + m_size), one halving at a time
+   // - The peak is the first position not lower than the next one: a lower
+   //   bound on the comparisons of the adjacent elements
+   // - 'step' halves the range without branching on the comparison, which
+   //   is best once the range fits in a few cache lines (no misprediction)
+   // - 'narrow' branches on it instead, which is best on large ranges: the
+   //   speculation of the next steps overlaps their cache misses
+   // - With several searches stepped in turn, their cache misses overlap
+   //--------------------------------------------------------------------------
+
+   template<typename RandomAccessIterator>
+   struct peak_search
+   {
+      using difference_type = typename std::iterator_traits<RandomAccessIterator>::difference_type;
+
+      RandomAccessIterator m_first;
+      std::size_t          m_size;
+
+      bool done() const
+      {
+         return m_size <= 1;
+      }
+
+      template<typename Less>
+      void step(Less& less)
+      {
+         std::size_t half = m_size / 2;
+         m_first += static_cast<difference_type>(half * std::size_t(less(m_first[half - 1], m_first[half])));
+         m_size -= half;
+      }
+
+      template<typename Less>
+      void narrow(Less& less)
+      {
+         std::size_t half = m_size / 2;
+         if (less(m_first[half - 1], m_first[half]))
+            m_first += static_cast<difference_type>(half);
+         m_size -= half;
+      }
+   };
+
+   template<typename RandomAccessIterator>
+   peak_search<RandomAccessIterator> start_peak_search(RandomAccessIterator first, RandomAccessIterator last)
+   {
+      return { first, static_cast<std::size_t>(std::distance(first, last)) };
+   }
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef INTERNAL_FOLD_BALANCED_HPP
+#define INTERNAL_FOLD_BALANCED_HPP
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+
+namespace details
+{
+   template<typename BinaryOp, typename Result>
+   constexpr bool is_sum_or_product =
+      std::is_same<BinaryOp, std::plus<Result>>::value || std::is_same<BinaryOp, std::plus<>>::value
+      || std::is_same<BinaryOp, std::multiplies<Result>>::value || std::is_same<BinaryOp, std::multiplies<>>::value;
+
+   template<typename Iterator, typename Result, typename BinaryOp>
+   constexpr bool is_lane_reducible =
+      std::is_arithmetic<Result>::value
+      && std::is_arithmetic<typename std::iterator_traits<Iterator>::value_type>::value
+      && std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<Iterator>::iterator_category>::value
+      && is_sum_or_product<BinaryOp, Result>;
+
+   //--------------------------------------------------------------------------
+   // Leaves of the tree of a balanced fold
+   // - In general, each element is a leaf
+   // - Sums and products of numbers use leaves of 128 elements, reduced in 8
+   //   independent lanes (which the compiler maps on SIMD registers) then by
+   //   pairs of lanes: the error stays in O(log n) as for pairwise summation,
+   //   without paying for the accumulator on each element
+   //--------------------------------------------------------------------------
+
+   template<typename Iterator, typename Result, typename BinaryOp>
+   struct balanced_leaves
+   {
+      static const std::size_t Bits = is_lane_reducible<Iterator, Result, BinaryOp> ? 7 : 0;
+      static const std::size_t Size = std::size_t(1) << Bits;
+      static const std::size_t Lanes = 8;
+
+      static Result reduce(Iterator first, BinaryOp& op)
+      {
+         if constexpr (Size == 1)
+         {
+            return *first;
+         }
+         else
+         {
+            Result lanes[Lanes];
+            for (std::size_t j = 0; j < Lanes; ++j)
+               lanes[j] = static_cast<Result>(first[j]);
+            for (std::size_t i = Lanes; i < Size; i += Lanes)
+               for (std::size_t j = 0; j < Lanes; ++j)
+                  lanes[j] = op(lanes[j], static_cast<Result>(first[i + j]));
+
+            for (std::size_t width = Lanes / 2; width > 0; width /= 2)
+               for (std::size_t j = 0; j < width; ++j)
+                  lanes[j] = op(lanes[2 * j], lanes[2 * j + 1]);
+            return lanes[0];
+         }
+      }
+   };
+
+   //--------------------------------------------------------------------------
+   // Balanced inclusive scan of a block of values, in place, in two sweeps
+   // - The up-sweep folds the aligned groups of 2^k values, as perfect binary
+   //   trees: each value ends up holding the fold of the group ending on it
+   //   (the largest one), the last value of a block of 2^k being its total
+   // - The down-sweep completes the prefixes from the largest groups down: a
+   //   prefix is the previous prefix combined with the group ending on it,
+   //   the first groups being combined after the 'offset' (if any)
+   // => Each prefix combines the same partial results, in the same order, as
+   //    a balanced fold of the values before it, with O(n) operations
+   //--------------------------------------------------------------------------
+
+   template<typename Result, typename BinaryOp>
+   void balanced_up_sweep(std::vector<Result>& values, BinaryOp& op)
+   {
+      std::size_t size = values.size();
+      for (std::size_t d = 1; d < size; d *= 2)
+         for (std::size_t i = 2 * d - 1; i < size; i += 2 * d)
+            values[i] = op(values[i - d], values[i]);
+   }
+
+   template<typename Result, typename BinaryOp>
+   void balanced_down_sweep(std::vector<Result>& values, std::optional<Result> const& offset, BinaryOp& op)
+   {
+      std::size_t size = values.size();
+      std::size_t top = 1;
+      while (top * 2 <= size)
+         top *= 2;
+
+      if (offset)
+      {
+         for (std::size_t p = 1; p <= size; p *= 2)
+            values[p - 1] = op(*offset, values[p - 1]);
+      }
+
+      for (std::size_t d = top / 2; d > 0; d /= 2)
+         for (std::size_t i = 3 * d - 1; i < size; i += 2 * d)
+            values[i] = op(values[i - d], values[i]);
+   }
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef INTERNAL_MAPPED_FILE_HPP
+#define INTERNAL_MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace details
+{
+   //--------------------------------------------------------------------------
+   // Read-only mapping of a whole file in memory
+   // The pages are shared by all the processes mapping the same file
+   //--------------------------------------------------------------------------
+
+   class mapped_file
+   {
+   public:
+      explicit mapped_file(std::string const& path) : m_data(nullptr), m_size(0)
+      {
+#if defined(_WIN32)
+         HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+         if (file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Cannot open " + path);
+
+         LARGE_INTEGER size;
+         if (!GetFileSizeEx(file, &size))
+         {
+            CloseHandle(file);
+            throw std::runtime_error("Cannot get the size of " + path);
+         }
+         m_size = static_cast<std::size_t>(size.QuadPart);
+         HANDLE mapping = m_size ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+         CloseHandle(file);
+         if (m_size && !mapping)
+            throw std::runtime_error("Cannot map " + path);
+
+         if (mapping)
+         {
+            m_data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+         }
+#else
+         int fd = ::open(path.c_str(), O_RDONLY);
+         if (fd < 0)
+            throw std::runtime_error("Cannot open " + path);
+
+         struct stat info;
+         if (::fstat(fd, &info) != 0)
+         {
+            ::close(fd);
+            throw std::runtime_error("Cannot get the size of " + path);
+         }
+         m_size = static_cast<std::size_t>(info.st_size);
+         if (m_size)
+         {
+            m_data = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (m_data == MAP_FAILED)
+               m_data = nullptr;
+         }
+         ::close(fd);
+#endif
+         if (m_size && !m_data)
+            throw std::runtime_error("Cannot map " + path);
+      }
+
+      ~mapped_file()
+      {
+         if (!m_data)
+            return;
+#if defined(_WIN32)
+         UnmapViewOfFile(m_data);
+#else
+         ::munmap(m_data, m_size);
+#endif
+      }
+
+      mapped_file(mapped_file&& other) : m_data(std::exchange(other.m_data, nullptr)), m_size(std::exchange(other.m_size, 0)) {}
+      mapped_file(mapped_file const&) = delete;
+      mapped_file& operator=(mapped_file const&) = delete;
+
+      char const* data() const { return static_cast<char const*>(m_data); }
+      std::size_t size() const { return m_size; }
+
+   private:
+      void*       m_data;
+      std::size_t m_size;
+   };
+}
+
+#endif
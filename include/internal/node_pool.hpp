@@ -0,0 +1,146 @@
+#ifndef INTERNAL_NODE_POOL_HPP
+#define INTERNAL_NODE_POOL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+
+namespace details
+{
+   //--------------------------------------------------------------------------
+   // Pool of memory blocks for the nodes of a data structure
+   // - Blocks are carved out of chunks of growing size, by size class
+   // - Released blocks are recycled through one free list per size class
+   // - Blocks too large for the size classes go to the global allocator
+   // - The pool counts its blocks in use, to know when it can be destroyed
+   //--------------------------------------------------------------------------
+
+   template<typename Mutex = std::mutex>
+   class node_pool
+   {
+   public:
+      static constexpr std::size_t Granularity = alignof(std::max_align_t);
+      static constexpr std::size_t ClassCount = 128;
+      static constexpr std::size_t MaxPooledSize = Granularity * ClassCount;
+      static constexpr std::size_t MinChunkSize = 1024;
+      static constexpr std::size_t MaxChunkSize = 64 * 1024;
+
+      node_pool() : m_mutex(), m_free(ClassCount, nullptr), m_chunks(), m_current(nullptr), m_remaining(0), m_used(0) {}
+      node_pool(node_pool const&) = delete;
+      node_pool& operator=(node_pool const&) = delete;
+
+      ~node_pool()
+      {
+         for (void* chunk : m_chunks)
+            ::operator delete(chunk);
+      }
+
+      void* allocate(std::size_t size)
+      {
+         if (size > MaxPooledSize)
+            return ::operator new(size);
+
+         std::size_t size_class = class_of(size);
+         std::lock_guard<Mutex> lock(m_mutex);
+         ++m_used;
+         if (free_block* block = m_free[size_class])
+         {
+            m_free[size_class] = block->m_next;
+            return block;
+         }
+
+         std::size_t block_size = (size_class + 1) * Granularity;
+         if (m_remaining < block_size)
+            new_chunk(block_size);
+
+         void* out = m_current;
+         m_current += block_size;
+         m_remaining -= block_size;
+         return out;
+      }
+
+      /** Bytes actually taken by a block of the given size */
+      static std::size_t block_size(std::size_t size)
+      {
+         return size > MaxPooledSize ? size : (class_of(size) + 1) * Granularity;
+      }
+
+      void deallocate(void* p, std::size_t size)
+      {
+         if (size > MaxPooledSize)
+            return ::operator delete(p);
+
+         std::size_t size_class = class_of(size);
+         std::lock_guard<Mutex> lock(m_mutex);
+         --m_used;
+         m_free[size_class] = new (p) free_block { m_free[size_class] };
+      }
+
+      /** Whether some blocks of the chunks are still allocated */
+      bool in_use()
+      {
+         std::lock_guard<Mutex> lock(m_mutex);
+         return m_used != 0;
+      }
+
+   private:
+      struct free_block
+      {
+         free_block* m_next;
+      };
+
+      Mutex                    m_mutex;
+      std::vector<free_block*> m_free;
+      std::vector<void*>       m_chunks;
+      char*                    m_current;
+      std::size_t              m_remaining;
+      std::size_t              m_used;
+
+      static std::size_t class_of(std::size_t size)
+      {
+         return (std::max<std::size_t>(size, 1) - 1) / Granularity;
+      }
+
+      void new_chunk(std::size_t block_size)
+      {
+         std::size_t growth = std::min<std::size_t>(m_chunks.size(), 6);
+         std::size_t chunk_size = std::max(block_size, std::min(MaxChunkSize, MinChunkSize << growth));
+         m_chunks.reserve(m_chunks.size() + 1);
+         m_current = static_cast<char*>(::operator new(chunk_size));
+         m_chunks.push_back(m_current);
+         m_remaining = chunk_size;
+      }
+   };
+
+   //--------------------------------------------------------------------------
+   // Same interface as node_pool, over the global allocator: for the nodes
+   // allocated and released by any thread, the per thread caches of malloc
+   // scale better than a pool behind a single lock
+   //--------------------------------------------------------------------------
+
+   class global_allocator
+   {
+   public:
+      static constexpr std::size_t Granularity = alignof(std::max_align_t);
+
+      void* allocate(std::size_t size)
+      {
+         return ::operator new(size);
+      }
+
+      static std::size_t block_size(std::size_t size)
+      {
+         return size;
+      }
+
+      void deallocate(void* p, std::size_t)
+      {
+         ::operator delete(p);
+      }
+   };
+}
+
+#endif
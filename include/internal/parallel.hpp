@@ -0,0 +1,73 @@
+#ifndef INTERNAL_PARALLEL_HPP
+#define INTERNAL_PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace details
+{
+   inline std::size_t default_thread_count()
+   {
+      return std::max<std::size_t>(1, std::thread::hardware_concurrency());
+   }
+
+   /** Start of the i-th of 'count' consecutive ranges of (almost) equal sizes splitting [0, size) */
+   inline std::size_t chunk_start(std::size_t size, std::size_t count, std::size_t i)
+   {
+      return size / count * i + std::min(i, size % count);
+   }
+
+   //--------------------------------------------------------------------------
+   // Run task(i) for each i in [0, count) on up to 'thread_count' threads,
+   // the calling thread included
+   // - The tasks are picked in order from a shared counter, so that the
+   //   threads stay busy even if the tasks are unbalanced
+   // - The first exception thrown by a task stops the remaining tasks and is
+   //   rethrown in the calling thread
+   //--------------------------------------------------------------------------
+
+   template<typename Task>
+   void parallel_for(std::size_t count, Task task, std::size_t thread_count = default_thread_count())
+   {
+      std::atomic<std::size_t> next(0);
+      std::exception_ptr error;
+      std::mutex error_mutex;
+
+      auto worker = [&]
+      {
+         for (std::size_t i = next.fetch_add(1, std::memory_order_relaxed); i < count; i = next.fetch_add(1, std::memory_order_relaxed))
+         {
+            try
+            {
+               task(i);
+            }
+            catch (...)
+            {
+               std::lock_guard<std::mutex> lock(error_mutex);
+               if (!error)
+                  error = std::current_exception();
+               next.store(count, std::memory_order_relaxed);
+            }
+         }
+      };
+
+      std::vector<std::thread> threads;
+      std::size_t helpers = std::min(thread_count, count);
+      for (std::size_t i = 1; i < helpers; ++i)
+         threads.emplace_back(worker);
+      worker();
+      for (auto& t : threads)
+         t.join();
+
+      if (error)
+         std::rethrow_exception(error);
+   }
+}
+
+#endif
@@ -0,0 +1,319 @@
+#ifndef INTERNAL_RADIX_SORT_HPP
+#define INTERNAL_RADIX_SORT_HPP
+
+#include <internal/counting_sort.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace details
+{
+   //--------------------------------------------------------------------------
+   // Keys of a radix sort, as unsigned integers with the same order
+   // - Signed integers: flip the sign bit
+   // - Floating points: flip the sign bit of positive numbers, and all the bits
+   //   of negative ones (-0.0 comes before 0.0, the NaNs go at both ends)
+   //--------------------------------------------------------------------------
+
+   template<typename Key>
+   auto radix_key(Key key)
+   {
+      static_assert(std::is_arithmetic<Key>::value, "Radix sort requires integer or floating point keys");
+
+      if constexpr (std::is_floating_point<Key>::value)
+      {
+         static_assert(sizeof(Key) == 4 || sizeof(Key) == 8, "Radix sort requires IEEE floating point keys");
+         using Bits = std::conditional_t<sizeof(Key) == 4, std::uint32_t, std::uint64_t>;
+         constexpr Bits sign = Bits(1) << (sizeof(Key) * 8 - 1);
+         Bits bits;
+         std::memcpy(&bits, &key, sizeof(Key));
+         return static_cast<Bits>(bits & sign ? ~bits : bits | sign);
+      }
+      else if constexpr (std::is_signed<Key>::value)
+      {
+         using Bits = std::make_unsigned_t<Key>;
+         constexpr Bits sign = Bits(1) << (sizeof(Key) * 8 - 1);
+         return static_cast<Bits>(static_cast<Bits>(key) ^ sign);
+      }
+      else
+      {
+         return key;
+      }
+   }
+
+   /** Digits of 11 bits: 3 passes for 32 bits keys, and a histogram that still fits in the L1 cache */
+   static const std::size_t RadixBits = 11;
+   static const std::size_t RadixSize = 1 << RadixBits;
+
+   using radix_counts = std::array<std::size_t, RadixSize>;
+
+   template<typename Bits>
+   std::size_t radix_digit(Bits key, std::size_t pass)
+   {
+      return static_cast<std::size_t>(key >> (pass * RadixBits)) & (RadixSize - 1);
+   }
+
+   //--------------------------------------------------------------------------
+   // Histograms of every digit of the keys, collected in a single pass
+   // - A digit identical for all keys does not need a pass of its own
+   // - Histograms of consecutive ranges can be added together
+   //--------------------------------------------------------------------------
+
+   template<typename Bits>
+   struct radix_histograms
+   {
+      static const std::size_t Passes = (sizeof(Bits) * 8 + RadixBits - 1) / RadixBits;
+
+      std::array<radix_counts, Passes> m_counts {};
+      Bits m_first_key = 0;
+      Bits m_differences = 0;
+      bool m_empty = true;
+
+      template<typename RandomIt, typename KeyOf>
+      void count(RandomIt first, RandomIt last, KeyOf key_of)
+      {
+         for (; first != last; ++first)
+         {
+            Bits key = key_of(*first);
+            if (m_empty)
+            {
+               m_first_key = key;
+               m_empty = false;
+            }
+            m_differences |= key ^ m_first_key;
+            for (std::size_t pass = 0; pass < Passes; ++pass)
+               ++m_counts[pass][radix_digit(key, pass)];
+         }
+      }
+
+      radix_histograms& operator+=(radix_histograms const& other)
+      {
+         if (other.m_empty)
+            return *this;
+         if (m_empty)
+            return *this = other;
+
+         m_differences |= other.m_differences | (other.m_first_key ^ m_first_key);
+         for (std::size_t pass = 0; pass < Passes; ++pass)
+            for (std::size_t d = 0; d < RadixSize; ++d)
+               m_counts[pass][d] += other.m_counts[pass][d];
+         return *this;
+      }
+
+      bool is_constant(std::size_t pass) const
+      {
+         return radix_digit(m_differences, pass) == 0;
+      }
+
+      /** Start of the bucket of each digit value, for the given pass */
+      radix_counts starts(std::size_t pass) const
+      {
+         radix_counts starts;
+         std::size_t total = 0;
+         for (std::size_t d = 0; d < RadixSize; ++d)
+         {
+            starts[d] = total;
+            total += m_counts[pass][d];
+         }
+         return starts;
+      }
+   };
+
+   template<typename RandomIt, typename KeyOf>
+   radix_counts count_digits(RandomIt first, RandomIt last, std::size_t pass, KeyOf key_of)
+   {
+      radix_counts counts {};
+      for (; first != last; ++first)
+         ++counts[radix_digit(key_of(*first), pass)];
+      return counts;
+   }
+
+   /** Turn the digit counts of consecutive ranges of the input into the starts of their slots in each bucket */
+   inline void radix_starts(std::vector<radix_counts>& ranges)
+   {
+      std::size_t total = 0;
+      for (std::size_t d = 0; d < RadixSize; ++d)
+      {
+         for (auto& counts : ranges)
+         {
+            std::size_t count = counts[d];
+            counts[d] = total;
+            total += count;
+         }
+      }
+   }
+
+   /** Stable counting pass on one digit: move each element at the next slot of its bucket */
+   template<typename RandomIt, typename OutputIt, typename KeyOf>
+   void radix_scatter(RandomIt first, RandomIt last, OutputIt out, radix_counts& starts, std::size_t pass, KeyOf key_of)
+   {
+      for (; first != last; ++first)
+         out[starts[radix_digit(key_of(*first), pass)]++] = std::move(*first);
+   }
+
+   //--------------------------------------------------------------------------
+   // Most significant digit radix sort, in place
+   // - 'key_byte(value, depth)' gives the byte of the key at 'depth', or -1
+   //   past the end of the key (a prefix comes before the longer keys)
+   // - Each range is permuted in 257 buckets (end of key, then each byte value)
+   //   and its buckets are sorted from the next depth on, except the keys that
+   //   ended, which are all equal
+   // - The ranges to sort are kept in an explicit stack, so that long common
+   //   prefixes cannot overflow the call stack
+   //--------------------------------------------------------------------------
+
+   static const std::size_t MsdBuckets = 257;
+   static const std::size_t MsdInsertionSortSize = 32;
+
+   template<typename KeyByte, typename RandomIt>
+   constexpr bool is_key_byte = std::is_invocable<KeyByte&, typename std::iterator_traits<RandomIt>::value_type const&, std::size_t>::value;
+
+   using msd_offsets = std::array<std::size_t, MsdBuckets>;
+
+   template<typename RandomIt>
+   struct msd_range
+   {
+      RandomIt    m_first;
+      RandomIt    m_last;
+      std::size_t m_depth;
+
+      std::size_t size() const { return m_last - m_first; }
+   };
+
+   /** Compare the keys from 'depth' on */
+   template<typename Value, typename KeyByte>
+   bool key_less(Value const& lhs, Value const& rhs, std::size_t depth, KeyByte& key_byte)
+   {
+      for (;; ++depth)
+      {
+         int l = key_byte(lhs, depth);
+         int r = key_byte(rhs, depth);
+         if (l != r)
+            return l < r;
+         if (l < 0)
+            return false;
+      }
+   }
+
+   template<typename RandomIt, typename KeyByte>
+   void insertion_sort_keys(msd_range<RandomIt> range, KeyByte& key_byte)
+   {
+      for (RandomIt curr = range.m_first; curr != range.m_last; ++curr)
+      {
+         auto value = std::move(*curr);
+         RandomIt hole = curr;
+         for (; hole != range.m_first && key_less(value, *(hole - 1), range.m_depth, key_byte); --hole)
+            *hole = std::move(*(hole - 1));
+         *hole = std::move(value);
+      }
+   }
+
+   /** Depth of the first byte not shared by all keys of the range (at least its depth) */
+   template<typename RandomIt, typename KeyByte>
+   std::size_t common_prefix_end(msd_range<RandomIt> range, KeyByte& key_byte)
+   {
+      std::size_t end = std::numeric_limits<std::size_t>::max();
+      for (RandomIt curr = range.m_first + 1; curr != range.m_last; ++curr)
+      {
+         std::size_t depth = range.m_depth;
+         for (int b = key_byte(*range.m_first, depth); depth < end && b >= 0 && b == key_byte(*curr, depth); b = key_byte(*range.m_first, depth))
+            ++depth;
+         end = depth;
+      }
+      return end;
+   }
+
+   /**
+    * Permute the range by the byte of the keys at its depth, and return the
+    * ends of the buckets. The prefix shared by all keys is skipped first, in
+    * a single pass, by increasing the depth of the range.
+    * The buckets of the elements are cached in 'buckets' during the count, so
+    * that the permutation does not need to access the keys again.
+    */
+   template<typename RandomIt, typename KeyByte>
+   msd_offsets msd_partition(msd_range<RandomIt>& range, KeyByte& key_byte, std::vector<std::uint16_t>& buckets)
+   {
+      buckets.resize(range.size());
+      msd_offsets ends {};
+      for (std::size_t i = 0; i < range.size(); ++i)
+      {
+         buckets[i] = static_cast<std::uint16_t>(key_byte(range.m_first[i], range.m_depth) + 1);
+         ++ends[buckets[i]];
+      }
+
+      auto single_bucket = std::find(ends.begin(), ends.end(), range.size());
+      if (single_bucket != ends.end() && single_bucket != ends.begin())
+      {
+         range.m_depth = common_prefix_end(range, key_byte);
+         return msd_partition(range, key_byte, buckets);
+      }
+
+      std::partial_sum(ends.begin(), ends.end(), ends.begin());
+      if (single_bucket != ends.end())
+         return ends;
+
+      msd_offsets nexts;
+      nexts[0] = 0;
+      std::copy(ends.begin(), ends.end() - 1, nexts.begin() + 1);
+      permute_to_buckets(nexts, ends,
+         [&](std::size_t i) { return buckets[i]; },
+         [&](std::size_t i, std::size_t j) {
+            std::iter_swap(range.m_first + i, range.m_first + j);
+            std::swap(buckets[i], buckets[j]);
+         });
+      return ends;
+   }
+
+   /** Push the buckets of a partitioned range that still need sorting */
+   template<typename RandomIt>
+   void push_buckets(msd_range<RandomIt> range, msd_offsets const& ends, std::vector<msd_range<RandomIt>>& ranges)
+   {
+      for (std::size_t b = 1; b < MsdBuckets; ++b)
+      {
+         if (ends[b] - ends[b - 1] > 1)
+            ranges.push_back({ range.m_first + ends[b - 1], range.m_first + ends[b], range.m_depth + 1 });
+      }
+   }
+
+   template<typename RandomIt, typename KeyByte>
+   void msd_radix_sort(msd_range<RandomIt> range, KeyByte key_byte)
+   {
+      std::vector<msd_range<RandomIt>> ranges { range };
+      std::vector<std::uint16_t> buckets;
+      while (!ranges.empty())
+      {
+         range = ranges.back();
+         ranges.pop_back();
+         if (range.size() <= MsdInsertionSortSize)
+         {
+            insertion_sort_keys(range, key_byte);
+            continue;
+         }
+
+         msd_offsets ends = msd_partition(range, key_byte, buckets);
+         push_buckets(range, ends, ranges);
+      }
+   }
+
+   /** Bytes of strings, or of any sequence of chars or bytes with a size */
+   struct string_key_byte
+   {
+      template<typename String>
+      int operator()(String const& s, std::size_t depth) const
+      {
+         return depth < s.size() ? static_cast<unsigned char>(s[depth]) : -1;
+      }
+   };
+}
+
+#endif
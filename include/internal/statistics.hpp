@@ -0,0 +1,95 @@
+#ifndef INTERNAL_STATISTICS_HPP
+#define INTERNAL_STATISTICS_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+
+namespace details
+{
+   /** Counter of an histogram, grown on demand */
+   inline std::size_t& histogram_at(std::vector<std::size_t>& histogram, std::size_t i)
+   {
+      if (histogram.size() <= i)
+         histogram.resize(i + 1, 0);
+      return histogram[i];
+   }
+
+   //--------------------------------------------------------------------------
+   // Memory shared between the versions of a persistent structure
+   // - The nodes reachable from a set of versions are registered once, with
+   //   their reference count, and each reference found from the versions or
+   //   from the registered nodes is recorded
+   // - A node would be released with the versions if all its references come
+   //   from the versions or from released nodes: the nodes are examined by
+   //   decreasing rank, parents having a higher rank than their childs
+   // - The reference counts are read without synchronization: the result is
+   //   an estimate if other threads update the structure meanwhile
+   //--------------------------------------------------------------------------
+
+   class sharing_analysis
+   {
+   public:
+      /** Record a reference to 'n' from a version (null 'parent') or from a registered node; true if 'n' is new */
+      bool add_reference(void const* n, void const* parent)
+      {
+         auto inserted = m_nodes.emplace(n, entry());
+         if (parent)
+            m_nodes.at(parent).m_childs.push_back(n);
+         else
+            inserted.first->second.m_version_refs++;
+         return inserted.second;
+      }
+
+      void describe(void const* n, std::size_t rank, std::uint32_t refs, std::size_t bytes)
+      {
+         entry& e = m_nodes[n];
+         e.m_rank = rank;
+         e.m_refs = refs;
+         e.m_bytes = bytes;
+      }
+
+      /** Bytes of the registered nodes that are not referenced from outside the versions */
+      std::size_t released_bytes()
+      {
+         std::vector<std::pair<void const*, entry*>> ranked;
+         ranked.reserve(m_nodes.size());
+         for (auto& n : m_nodes)
+         {
+            n.second.m_released_refs = n.second.m_version_refs;
+            ranked.emplace_back(n.first, &n.second);
+         }
+         std::sort(ranked.begin(), ranked.end(), [](auto const& lhs, auto const& rhs) { return lhs.second->m_rank > rhs.second->m_rank; });
+
+         std::size_t released = 0;
+         for (auto const& n : ranked)
+         {
+            if (n.second->m_released_refs < n.second->m_refs)
+               continue;
+
+            released += n.second->m_bytes;
+            for (void const* child : n.second->m_childs)
+               m_nodes[child].m_released_refs++;
+         }
+         return released;
+      }
+
+   private:
+      struct entry
+      {
+         std::size_t              m_rank = 0;
+         std::uint32_t            m_refs = 0;
+         std::uint32_t            m_version_refs = 0;
+         std::uint32_t            m_released_refs = 0;
+         std::size_t              m_bytes = 0;
+         std::vector<void const*> m_childs;
+      };
+
+      std::unordered_map<void const*, entry> m_nodes;
+   };
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef INTERNAL_THREADING_HPP
+#define INTERNAL_THREADING_HPP
+
+#include <internal/node_pool.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+
+namespace details
+{
+   //--------------------------------------------------------------------------
+   // Reference counts embedded in the nodes of a data structure
+   // - They start at 1, the reference of the creator of the node
+   // - 'release' tells whether the last reference was dropped
+   //--------------------------------------------------------------------------
+
+   class atomic_ref_count
+   {
+   public:
+      atomic_ref_count() : m_count(1) {}
+      atomic_ref_count(atomic_ref_count const&) = delete;
+      atomic_ref_count& operator=(atomic_ref_count const&) = delete;
+
+      void acquire()              { m_count.fetch_add(1, std::memory_order_relaxed); }
+      bool release()              { return m_count.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+      bool unique() const         { return m_count.load(std::memory_order_acquire) == 1; }
+      std::uint32_t count() const { return m_count.load(std::memory_order_relaxed); }
+
+   private:
+      std::atomic<std::uint32_t> m_count;
+   };
+
+   class local_ref_count
+   {
+   public:
+      local_ref_count() : m_count(1) {}
+      local_ref_count(local_ref_count const&) = delete;
+      local_ref_count& operator=(local_ref_count const&) = delete;
+
+      void acquire()              { ++m_count; }
+      bool release()              { return --m_count == 0; }
+      bool unique() const         { return m_count == 1; }
+      std::uint32_t count() const { return m_count; }
+
+   private:
+      std::uint32_t m_count;
+   };
+
+   struct null_mutex
+   {
+      void lock() {}
+      void unlock() {}
+   };
+
+   /** For very short critical sections, such as popping a free list */
+   class spin_mutex
+   {
+   public:
+      spin_mutex() = default;
+      spin_mutex(spin_mutex const&) = delete;
+      spin_mutex& operator=(spin_mutex const&) = delete;
+
+      void lock()
+      {
+         while (m_locked.exchange(true, std::memory_order_acquire))
+         {
+            while (m_locked.load(std::memory_order_relaxed))
+               std::this_thread::yield();
+         }
+      }
+
+      void unlock()
+      {
+         m_locked.store(false, std::memory_order_release);
+      }
+
+   private:
+      std::atomic<bool> m_locked { false };
+   };
+
+   //--------------------------------------------------------------------------
+   // Threading policies
+   // - multi_threaded: the structures can be shared between threads, and use
+   //   one process-wide instance of their resources; their nodes come from the
+   //   global allocator (a pool behind a lock would serialize all threads)
+   // - single_threaded: the structures and everything they share stay on the
+   //   thread that created them, and use one instance of their resources per
+   //   thread, without synchronization (such as a node pool)
+   // The process-wide instances are never destroyed, so that structures with a
+   // static storage duration can still release their nodes at exit. The
+   // instance of a thread is destroyed when the thread exits, unless it is
+   // still in use (by such structures), in which case it is kept.
+   //--------------------------------------------------------------------------
+
+   struct multi_threaded
+   {
+      using ref_count = atomic_ref_count;
+      using mutex = spin_mutex;
+      using pool = global_allocator;
+
+      template<typename Resource>
+      static Resource& instance()
+      {
+         static Resource* resource = new Resource();
+         return *resource;
+      }
+   };
+
+   struct single_threaded
+   {
+      using ref_count = local_ref_count;
+      using mutex = null_mutex;
+      using pool = node_pool<null_mutex>;
+
+      template<typename Resource>
+      static Resource& instance()
+      {
+         static thread_local Resource* resource = nullptr;
+         if (!resource)
+         {
+            resource = new Resource();
+            static thread_local release_at_exit<Resource> release { resource };
+         }
+         return *resource;
+      }
+
+   private:
+      template<typename Resource>
+      struct release_at_exit
+      {
+         Resource*& m_resource;
+
+         ~release_at_exit()
+         {
+            if (!m_resource->in_use())
+            {
+               delete m_resource;
+               m_resource = nullptr;
+            }
+         }
+      };
+   };
+}
+
+#endif
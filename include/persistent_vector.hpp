@@ -1,183 +1,1361 @@
 #pragma once
 
+#include <internal/node_pool.hpp>
+#include <internal/parallel.hpp>
+#include <internal/statistics.hpp>
+#include <internal/threading.hpp>
+
 #include <algorithm>
 #include <array>
-#include <bitset>
+#include <cstdint>
 #include <functional>
-#include <iostream>
+#include <iterator>
 #include <memory>
+#include <new>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
 #include <utility>
 #include <vector>
 
 
+namespace details
+{
+   template<typename Vector>
+   class pv_chunk_iterator;
+
+   template<typename Vector>
+   class pv_const_iterator;
+}
+
+
 /**
  * An attempt at implementing a persistent vector
+ *
+ * The elements are stored in a tree of blocks of 32 elements, the position
+ * of an element in the tree being given by the digits (5 bits per level)
+ * of its index. The last block (the tail) is kept out of the tree, so that
+ * appending an element only touches the tree once every 32 elements.
+ *
+ * Slicing and concatenating vectors leave partially filled blocks in the
+ * tree: the nodes above them are "relaxed" and keep a table of the sizes of
+ * their sub-trees, from which the index is searched instead of computed
+ * (relaxed radix balanced trees). A concatenation only rebuilds the nodes
+ * along the junction of the two trees, in O(log n).
+ *
+ * Updating an rvalue vector updates in place the blocks that are not shared
+ * with another vector (see also transient_vector to build a vector).
+ *
+ * The nodes embed their reference count and the blocks store their elements
+ * inline. The threading policy selects atomic reference counts and the global
+ * allocator (details::multi_threaded), or plain reference counts and a pool
+ * per thread, shared by the vectors of the same type (details::single_threaded)
+ * for vectors that never leave the thread that created them.
+ *
+ * Besides the iterators on the elements, the vector can be traversed by
+ * chunks: each chunk is a block of contiguous elements, so that the inner
+ * loops of a traversal run over plain arrays. The parallel traversals split
+ * the tree into sub-trees and visit them on several threads.
  */
+template<typename value_type, typename Threading>
+class transient_vector;
+
+//-----------------------------------------------------------------------------
+
 template<
-   typename value_type
+   typename value_type,
+   typename Threading = details::multi_threaded
 >
 class persistent_vector
 {
+   friend class transient_vector<value_type, Threading>;
+   friend class details::pv_chunk_iterator<persistent_vector>;
+   friend class details::pv_const_iterator<persistent_vector>;
+
 private:
    static constexpr std::size_t BlockBits = 5;
    static constexpr std::size_t BlockSize = 1 << BlockBits;
+   static constexpr std::size_t BlockMask = BlockSize - 1;
+   static constexpr std::size_t MaxDepth = (sizeof(std::size_t) * 8 + BlockBits - 1) / BlockBits;
+   static constexpr std::size_t TasksPerThread = 8; //Sub-trees per thread in parallel traversals
+   static constexpr std::size_t ExtraBlocks = 2; //Blocks tolerated above the optimal count at a concatenation
+
+   using element = value_type;
+   using ref_count = typename Threading::ref_count;
+   using pool = typename Threading::pool;
 
    enum class kind : char { leaf = 0, intern = 1 };
 
    struct node
    {
-      node(): node(kind::leaf) {}
-      node(kind k) : m_kind(k) {}
-      const kind m_kind;
+      explicit node(kind k) : m_refs(), m_kind(k), m_count(0) {}
+      ref_count     m_refs;
+      const kind    m_kind;
+      std::uint32_t m_count;   //Number of elements of a leaf, or of childs of an intern node
    };
 
-   using node_ptr = std::shared_ptr<node>;
-
    struct leaf_node : node
    {
-      leaf_node(): node(kind::leaf), m_values() {}
-      std::vector<value_type> m_values;
+      leaf_node() : node(kind::leaf) {}
+      value_type*       values()       { return reinterpret_cast<value_type*>(m_storage); }
+      value_type const* values() const { return reinterpret_cast<value_type const*>(m_storage); }
+      alignas(value_type) unsigned char m_storage[BlockSize * sizeof(value_type)];
    };
 
    struct intern_node : node
    {
-      intern_node(): node(kind::intern), m_first(0), m_last(0), m_height(1), m_childs() {}
-      std::size_t             m_first;
-      std::size_t             m_last;
-      std::size_t             m_height; //Height of the sub-tree
-      std::vector<node_ptr>   m_childs;
+      intern_node() : node(kind::intern), m_sizes(nullptr) {}
+      std::size_t* m_sizes;            //Cumulated sizes of the childs, null if the node is not relaxed
+      node*        m_childs[BlockSize];
    };
 
+   static_assert(alignof(leaf_node) <= pool::Granularity, "Over-aligned elements are not supported");
+
 public:
-   persistent_vector() : m_root(new leaf_node) {}
-   ~persistent_vector() = default;
-   persistent_vector(persistent_vector const&) = default;
-   persistent_vector& operator=(persistent_vector const&) = default;
+   /** Contiguous elements of the vector */
+   class chunk
+   {
+   public:
+      chunk() : m_first(nullptr), m_last(nullptr) {}
+      chunk(value_type const* first, value_type const* last) : m_first(first), m_last(last) {}
+
+      value_type const* begin() const { return m_first; }
+      value_type const* end() const   { return m_last; }
+      std::size_t size() const        { return static_cast<std::size_t>(m_last - m_first); }
+
+   private:
+      value_type const* m_first;
+      value_type const* m_last;
+   };
+
+   using const_iterator = details::pv_const_iterator<persistent_vector>;
+   using chunk_iterator = details::pv_chunk_iterator<persistent_vector>;
+
+   persistent_vector() : m_size(0), m_shift(BlockBits), m_root(nullptr), m_tail(nullptr) {}
+
+   ~persistent_vector()
+   {
+      release(m_root);
+      release(m_tail);
+   }
+
+   persistent_vector(persistent_vector const& other)
+      : m_size(other.m_size), m_shift(other.m_shift), m_root(other.m_root), m_tail(other.m_tail)
+   {
+      acquire(m_root);
+      acquire(m_tail);
+   }
+
+   persistent_vector(persistent_vector&& other)
+      : m_size(other.m_size), m_shift(other.m_shift), m_root(other.m_root), m_tail(other.m_tail)
+   {
+      other.m_size = 0;
+      other.m_shift = BlockBits;
+      other.m_root = nullptr;
+      other.m_tail = nullptr;
+   }
+
+   persistent_vector& operator=(persistent_vector const& other)
+   {
+      persistent_vector copy(other);
+      swap(copy);
+      return *this;
+   }
+
+   persistent_vector& operator=(persistent_vector&& other)
+   {
+      persistent_vector moved(std::move(other));
+      swap(moved);
+      return *this;
+   }
+
+   void swap(persistent_vector& other)
+   {
+      std::swap(m_size, other.m_size);
+      std::swap(m_shift, other.m_shift);
+      std::swap(m_root, other.m_root);
+      std::swap(m_tail, other.m_tail);
+   }
 
    std::size_t size() const
    {
-      return get_size(m_root.get());
+      return m_size;
+   }
+
+   bool empty() const
+   {
+      return 0 == m_size;
    }
 
    value_type const& at(std::size_t index) const
    {
       if (index >= size())
-         throw std::exception("Wrong size");
-      return get_at(m_root, index);
+         throw std::out_of_range("Wrong size");
+      return get_at(index);
+   }
+
+   persistent_vector push_back(value_type const& v) const&
+   {
+      persistent_vector out(*this);
+      out.push_back_in_place(v);
+      return out;
+   }
+
+   persistent_vector push_back(value_type const& v) &&
+   {
+      persistent_vector out(std::move(*this));
+      out.push_back_in_place(v);
+      return out;
+   }
+
+   persistent_vector set(std::size_t index, value_type const& v) const&
+   {
+      persistent_vector out(*this);
+      out.set_at(index, v);
+      return out;
+   }
+
+   persistent_vector set(std::size_t index, value_type const& v) &&
+   {
+      persistent_vector out(std::move(*this));
+      out.set_at(index, v);
+      return out;
+   }
+
+   template<typename Updater>
+   persistent_vector update(std::size_t index, Updater f) const
+   {
+      return set(index, f(at(index)));
+   }
+
+   persistent_vector pop_back() const&
+   {
+      persistent_vector out(*this);
+      out.pop_back_in_place();
+      return out;
+   }
+
+   persistent_vector pop_back() &&
+   {
+      persistent_vector out(std::move(*this));
+      out.pop_back_in_place();
+      return out;
+   }
+
+   /** The first 'count' elements (all of them if count >= size) */
+   persistent_vector take(std::size_t count) const
+   {
+      if (count >= m_size)
+         return *this;
+      if (0 == count)
+         return persistent_vector();
+
+      persistent_vector out(*this);
+      std::size_t tail_index = tail_offset();
+      if (count > tail_index)
+      {
+         release(out.m_tail);
+         out.m_tail = copy_leaf(m_tail, 0, count - tail_index);
+      }
+      else
+      {
+         node* root = take_tree(m_root, m_shift, count);
+         release(out.m_root);
+         release(out.m_tail);
+         out.m_root = root;
+         out.m_tail = out.pop_leaf();
+      }
+      out.m_size = count;
+      return out;
+   }
+
+   /** The elements after the first 'count' elements (none if count >= size) */
+   persistent_vector drop(std::size_t count) const
+   {
+      if (0 == count)
+         return *this;
+      if (count >= m_size)
+         return persistent_vector();
+
+      persistent_vector out(*this);
+      std::size_t tail_index = tail_offset();
+      if (count >= tail_index)
+      {
+         release(out.m_root);
+         release(out.m_tail);
+         out.m_root = nullptr;
+         out.m_shift = BlockBits;
+         out.m_tail = copy_leaf(m_tail, count - tail_index, m_tail->m_count);
+      }
+      else
+      {
+         node* root = drop_tree(m_root, m_shift, count);
+         release(out.m_root);
+         out.m_root = root;
+         out.shrink_root();
+      }
+      out.m_size = m_size - count;
+      return out;
+   }
+
+   /** The elements in [first, last), the bounds being clamped to the size */
+   persistent_vector slice(std::size_t first, std::size_t last) const
+   {
+      last = std::min(last, m_size);
+      first = std::min(first, last);
+      return drop(first).take(last - first);
+   }
+
+   /** The elements of this vector followed by the elements of 'other' */
+   persistent_vector concat(persistent_vector const& other) const
+   {
+      if (other.empty())
+         return *this;
+      if (empty())
+         return other;
+
+      persistent_vector out(*this);
+      if (!other.m_root)
+      {
+         for (std::size_t i = 0; i < other.m_tail->m_count; ++i)
+            out.push_back_in_place(other.m_tail->values()[i]);
+         return out;
+      }
+
+      leaf_node* tail = out.m_tail;
+      out.m_tail = nullptr;
+      out.push_leaf(tail, tail->m_count);
+
+      node* root = concat_trees(out.m_root, out.m_shift, other.m_root, other.m_shift);
+      release(out.m_root);
+      out.m_root = root;
+      out.m_shift = std::max(out.m_shift, other.m_shift) + BlockBits;
+      out.m_tail = other.m_tail;
+      acquire(out.m_tail);
+      out.m_size = m_size + other.m_size;
+      out.shrink_root();
+      return out;
+   }
+
+   transient_vector<value_type, Threading> transient() const;
+
+   const_iterator begin() const
+   {
+      return const_iterator(begin_chunks());
+   }
+
+   const_iterator end() const
+   {
+      return const_iterator();
+   }
+
+   chunk_iterator begin_chunks() const
+   {
+      return chunk_iterator(m_root, m_tail);
+   }
+
+   chunk_iterator end_chunks() const
+   {
+      return chunk_iterator();
+   }
+
+   /** Visit the chunks of the vector in order */
+   template<typename Visitor>
+   void for_each_chunk(Visitor f) const
+   {
+      if (m_root)
+         for_each_chunk(m_root, m_shift, f);
+      if (m_tail)
+         f(tail_chunk());
+   }
+
+   /**
+    * Visit the chunks of the vector on up to 'thread_count' threads (the
+    * calling thread included): the chunks are visited concurrently and in
+    * no particular order
+    */
+   template<typename Visitor>
+   void parallel_for_each_chunk(Visitor f, std::size_t thread_count = details::default_thread_count()) const
+   {
+      std::size_t level = 0;
+      std::vector<node const*> parts = split_tree(TasksPerThread * thread_count, level);
+      details::parallel_for(parts.size() + 1, [&](std::size_t i) {
+         if (i < parts.size())
+            for_each_chunk(parts[i], level, f);
+         else if (m_tail)
+            f(tail_chunk());
+      }, thread_count);
    }
 
-   persistent_vector push_back(value_type const& v) const
+   /**
+    * Combine 'init' and the elements with the associative 'op', on up to
+    * 'thread_count' threads (the calling thread included). The elements are
+    * combined in order, so 'op' need not be commutative.
+    */
+   template<typename T, typename BinaryOp>
+   T parallel_reduce(T init, BinaryOp op, std::size_t thread_count = details::default_thread_count()) const
    {
-      return persistent_vector(push_back(m_root, v));
+      std::size_t level = 0;
+      std::vector<node const*> parts = split_tree(TasksPerThread * thread_count, level);
+      std::vector<std::optional<T>> partials(parts.size() + 1);
+      details::parallel_for(partials.size(), [&](std::size_t i) {
+         auto fold = [&](chunk const& c) {
+            value_type const* first = c.begin();
+            if (!partials[i])
+               partials[i].emplace(*first++);
+            T value = std::move(*partials[i]);
+            for (; first != c.end(); ++first)
+               value = op(std::move(value), *first);
+            *partials[i] = std::move(value);
+         };
+         if (i < parts.size())
+            for_each_chunk(parts[i], level, fold);
+         else if (m_tail)
+            fold(tail_chunk());
+      }, thread_count);
+
+      for (auto& partial : partials)
+      {
+         if (partial)
+            init = op(std::move(init), std::move(*partial));
+      }
+      return init;
+   }
+
+   /** Shape and memory footprint of one or several versions of a vector */
+   struct statistics
+   {
+      std::vector<std::size_t> m_nodes_by_level;   //Nodes at each level (0 for the blocks, tails included)
+      std::size_t              m_relaxed_nodes = 0;
+      std::size_t              m_elements = 0;     //Elements in the blocks (a shared block is counted once)
+      std::size_t              m_childs = 0;       //Childs of the intern nodes
+      std::size_t              m_bytes = 0;
+      std::size_t              m_unique_bytes = 0; //Bytes released if these versions were dropped
+      std::size_t              m_shared_bytes = 0; //Bytes shared with other versions
+
+      double average_fan_out() const
+      {
+         std::size_t blocks = m_nodes_by_level.empty() ? 0 : m_nodes_by_level[0];
+         std::size_t interns = std::accumulate(m_nodes_by_level.begin(), m_nodes_by_level.end(), std::size_t(0)) - blocks;
+         return interns ? static_cast<double>(m_childs) / interns : 0.;
+      }
+
+      double average_block_size() const
+      {
+         std::size_t blocks = m_nodes_by_level.empty() ? 0 : m_nodes_by_level[0];
+         return blocks ? static_cast<double>(m_elements) / blocks : 0.;
+      }
+   };
+
+   statistics stats() const
+   {
+      return stats(this, this + 1);
+   }
+
+   /** Statistics of the versions in [first, last), counting the nodes they share once */
+   template<typename Iterator>
+   static statistics stats(Iterator first, Iterator last)
+   {
+      statistics out;
+      details::sharing_analysis sharing;
+      for (; first != last; ++first)
+      {
+         if (first->m_root)
+            collect_stats(first->m_root, nullptr, first->m_shift, sharing, out);
+         if (first->m_tail)
+            collect_stats(first->m_tail, nullptr, 0, sharing, out);
+      }
+      out.m_unique_bytes = sharing.released_bytes();
+      out.m_shared_bytes = out.m_bytes - out.m_unique_bytes;
+      return out;
    }
 
 private:
-   node_ptr m_root;
+   std::size_t m_size;
+   std::size_t m_shift; //Bits of the index consumed above the leaves
+   node*       m_root;  //Null if all the elements fit in the tail
+   leaf_node*  m_tail;  //Null if the vector is empty
 
-   persistent_vector(node_ptr const& r) : m_root(r) {}
+   std::size_t tail_offset() const
+   {
+      return m_tail ? m_size - m_tail->m_count : m_size;
+   }
 
-   static std::size_t get_size(node const* n)
+   chunk tail_chunk() const
    {
-      if (!n) return 0;
-      if (n->m_kind == kind::leaf)
-         return static_cast<leaf_node const*>(n)->m_values.size();
+      return chunk(m_tail->values(), m_tail->values() + m_tail->m_count);
+   }
+
+   static intern_node* as_intern(node* n)             { return static_cast<intern_node*>(n); }
+   static intern_node const* as_intern(node const* n) { return static_cast<intern_node const*>(n); }
+   static leaf_node* as_leaf(node* n)                 { return static_cast<leaf_node*>(n); }
+   static leaf_node const* as_leaf(node const* n)     { return static_cast<leaf_node const*>(n); }
 
-      intern_node const* in = static_cast<intern_node const*>(n);
-      return in->m_last - in->m_first;
+   //--------------------------------------------------------------------------
+   // Index search: the childs of a node at 'level' hold at most 2^level
+   // elements, so (index >> level) is the position of the child in a node
+   // that is not relaxed, and a lower bound for it in a relaxed node
+   //--------------------------------------------------------------------------
+
+   static std::size_t child_index(intern_node const* n, std::size_t level, std::size_t& index)
+   {
+      std::size_t child = index >> level;
+      if (!n->m_sizes)
+      {
+         index -= child << level;
+         return child;
+      }
+
+      while (n->m_sizes[child] <= index)
+         ++child;
+      if (child > 0)
+         index -= n->m_sizes[child - 1];
+      return child;
+   }
+
+   value_type const& get_at(std::size_t index) const
+   {
+      std::size_t tail_index = tail_offset();
+      if (index >= tail_index)
+         return m_tail->values()[index - tail_index];
+
+      node const* n = m_root;
+      for (std::size_t level = m_shift; level > 0; level -= BlockBits)
+      {
+         auto intern = as_intern(n);
+         n = intern->m_childs[child_index(intern, level, index)];
+      }
+      return as_leaf(n)->values()[index];
+   }
+
+   //--------------------------------------------------------------------------
+   // Traversals by chunks
+   //--------------------------------------------------------------------------
+
+   template<typename Visitor>
+   static void for_each_chunk(node const* n, std::size_t level, Visitor& f)
+   {
+      if (0 == level)
+      {
+         leaf_node const* leaf = as_leaf(n);
+         f(chunk(leaf->values(), leaf->values() + leaf->m_count));
+         return;
+      }
+
+      intern_node const* intern = as_intern(n);
+      for (std::size_t i = 0; i < intern->m_count; ++i)
+         for_each_chunk(intern->m_childs[i], level - BlockBits, f);
    }
 
-   static std::size_t max_size(node const* n)
+   static void collect_stats(node const* n, node const* parent, std::size_t level, details::sharing_analysis& sharing, statistics& out)
    {
-      if (!n) return 0;
-      if (n->m_kind == kind::leaf) return BlockSize;
+      if (!sharing.add_reference(n, parent))
+         return;
+
+      std::size_t bytes = node_bytes(n);
+      sharing.describe(n, level, n->m_refs.count(), bytes);
+      details::histogram_at(out.m_nodes_by_level, level / BlockBits)++;
+      out.m_bytes += bytes;
+      if (0 == level)
+      {
+         out.m_elements += n->m_count;
+         return;
+      }
 
-      auto* i = static_cast<intern_node const*>(n);
-      return 1 << (BlockBits * (1 + i->m_height));
+      intern_node const* intern = as_intern(n);
+      out.m_childs += intern->m_count;
+      out.m_relaxed_nodes += intern->m_sizes ? 1 : 0;
+      for (std::size_t i = 0; i < intern->m_count; ++i)
+         collect_stats(intern->m_childs[i], n, level - BlockBits, sharing, out);
    }
 
-   static node_ptr create_leaf(value_type const& v)
+   static std::size_t node_bytes(node const* n)
    {
-      std::shared_ptr<leaf_node> out(new leaf_node());
-      out->m_values.push_back(v);
+      if (kind::leaf == n->m_kind)
+         return pool::block_size(sizeof(leaf_node));
+
+      std::size_t sizes = as_intern(n)->m_sizes ? pool::block_size(BlockSize * sizeof(std::size_t)) : 0;
+      return pool::block_size(sizeof(intern_node)) + sizes;
+   }
+
+   /** Split the tree in order into sub-trees of the same 'level', at least 'count' of them if possible */
+   std::vector<node const*> split_tree(std::size_t count, std::size_t& level) const
+   {
+      std::vector<node const*> parts;
+      if (!m_root)
+         return parts;
+
+      parts.push_back(m_root);
+      for (level = m_shift; parts.size() < count && level > 0; level -= BlockBits)
+      {
+         std::vector<node const*> childs;
+         for (node const* part : parts)
+            childs.insert(childs.end(), as_intern(part)->m_childs, as_intern(part)->m_childs + part->m_count);
+         parts.swap(childs);
+      }
+      return parts;
+   }
+
+   //--------------------------------------------------------------------------
+   // Node lifecycle: the nodes are allocated in the pool with a reference
+   // count of 1, and go back to the pool when their last reference is released
+   //--------------------------------------------------------------------------
+
+   static pool& node_pool()
+   {
+      return Threading::template instance<pool>();
+   }
+
+   static leaf_node* allocate_leaf()
+   {
+      return new (node_pool().allocate(sizeof(leaf_node))) leaf_node();
+   }
+
+   static intern_node* allocate_intern()
+   {
+      return new (node_pool().allocate(sizeof(intern_node))) intern_node();
+   }
+
+   static void acquire(node* n)
+   {
+      if (n)
+         n->m_refs.acquire();
+   }
+
+   static void release(node* n)
+   {
+      if (!n || !n->m_refs.release())
+         return;
+
+      if (kind::leaf == n->m_kind)
+      {
+         leaf_node* leaf = as_leaf(n);
+         std::for_each(leaf->values(), leaf->values() + leaf->m_count, [](value_type& v) { v.~value_type(); });
+         leaf->~leaf_node();
+         node_pool().deallocate(leaf, sizeof(leaf_node));
+      }
+      else
+      {
+         intern_node* intern = as_intern(n);
+         std::for_each(intern->m_childs, intern->m_childs + intern->m_count, release);
+         set_relaxed(*intern, false);
+         intern->~intern_node();
+         node_pool().deallocate(intern, sizeof(intern_node));
+      }
+   }
+
+   static void set_relaxed(intern_node& n, bool relaxed)
+   {
+      if (relaxed && !n.m_sizes)
+      {
+         n.m_sizes = static_cast<std::size_t*>(node_pool().allocate(BlockSize * sizeof(std::size_t)));
+      }
+      else if (!relaxed && n.m_sizes)
+      {
+         node_pool().deallocate(n.m_sizes, BlockSize * sizeof(std::size_t));
+         n.m_sizes = nullptr;
+      }
+   }
+
+   static leaf_node* copy_leaf(leaf_node const* from, std::size_t first, std::size_t last)
+   {
+      leaf_node* out = allocate_leaf();
+      std::uninitialized_copy(from->values() + first, from->values() + last, out->values());
+      out->m_count = static_cast<std::uint32_t>(last - first);
+      return out;
+   }
+
+   static leaf_node* copy_node(leaf_node const* from)
+   {
+      return copy_leaf(from, 0, from->m_count);
+   }
+
+   static intern_node* copy_node(intern_node const* from)
+   {
+      intern_node* out = allocate_intern();
+      append_childs(*out, from->m_childs, from->m_childs + from->m_count);
+      if (from->m_sizes)
+      {
+         set_relaxed(*out, true);
+         std::copy(from->m_sizes, from->m_sizes + from->m_count, out->m_sizes);
+      }
       return out;
    }
 
+   /** Append shared childs (a reference is acquired on each of them) */
+   static void append_childs(intern_node& n, node* const* first, node* const* last)
+   {
+      std::for_each(first, last, acquire);
+      std::copy(first, last, n.m_childs + n.m_count);
+      n.m_count += static_cast<std::uint32_t>(last - first);
+   }
+
+   /** Append a child whose reference is transferred to the node */
+   static void append_child(intern_node& n, node* child)
+   {
+      n.m_childs[n.m_count++] = child;
+   }
+
+   //--------------------------------------------------------------------------
+   // Sizes of sub-trees
+   //--------------------------------------------------------------------------
+
+   static std::size_t size_of(node const* n, std::size_t level)
+   {
+      if (0 == level)
+         return n->m_count;
+
+      auto intern = as_intern(n);
+      if (intern->m_sizes)
+         return intern->m_sizes[intern->m_count - 1];
+      return ((intern->m_count - 1) << level) + size_of(intern->m_childs[intern->m_count - 1], level - BlockBits);
+   }
+
+   /** Relax the node if one of its childs but the last one is not full */
+   static void compute_sizes(intern_node& n, std::size_t level)
+   {
+      std::size_t capacity = std::size_t(1) << level;
+      std::array<std::size_t, BlockSize> sizes;
+      std::size_t total = 0;
+      bool relaxed = false;
+      for (std::size_t i = 0; i < n.m_count; ++i)
+      {
+         std::size_t child_size = size_of(n.m_childs[i], level - BlockBits);
+         relaxed = relaxed || (i + 1 < n.m_count && child_size != capacity);
+         total += child_size;
+         sizes[i] = total;
+      }
+
+      set_relaxed(n, relaxed);
+      if (relaxed)
+         std::copy(sizes.begin(), sizes.begin() + n.m_count, n.m_sizes);
+   }
+
+   static bool has_room(node const* n, std::size_t level)
+   {
+      auto intern = as_intern(n);
+      if (intern->m_count < BlockSize)
+         return true;
+      return level > BlockBits && has_room(intern->m_childs[intern->m_count - 1], level - BlockBits);
+   }
+
+   //--------------------------------------------------------------------------
+   // In place updates: a node referenced by this vector only is updated in
+   // place, a node shared with another vector is copied first. Copying a
+   // node shares its sub-nodes, so the copy propagates down the path.
    //--------------------------------------------------------------------------
 
-   static value_type const& get_at(node_ptr const& n, std::size_t index)
+   template<typename Node, typename Ptr>
+   static Node* owned(Ptr& n)
    {
-      if (n->m_kind == kind::leaf)
-         return static_cast<leaf_node const*>(n.get())->m_values[index];
+      if (!n->m_refs.unique())
+      {
+         Node* copy = copy_node(static_cast<Node const*>(n));
+         release(n);
+         n = copy;
+      }
+      return static_cast<Node*>(n);
+   }
+
+   void push_back_in_place(value_type v)
+   {
+      if (!m_tail)
+      {
+         m_tail = allocate_leaf();
+      }
+      else if (m_tail->m_count == BlockSize)
+      {
+         push_leaf(m_tail, BlockSize);
+         m_tail = allocate_leaf();
+      }
+
+      leaf_node* tail = owned<leaf_node>(m_tail);
+      new (tail->values() + tail->m_count) value_type(std::move(v));
+      tail->m_count++;
+      m_size++;
+   }
+
+   void set_in_place(std::size_t index, value_type v)
+   {
+      std::size_t tail_index = tail_offset();
+      if (index >= tail_index)
+      {
+         owned<leaf_node>(m_tail)->values()[index - tail_index] = std::move(v);
+         return;
+      }
 
-      //TODO - Could be done by just dividing when updating
-      //TODO - Could be done by selecting the last one when push back
-      auto* i = static_cast<intern_node const*>(n.get());
-      for (auto const& n : i->m_childs)
+      node** n = &m_root;
+      for (std::size_t level = m_shift; level > 0; level -= BlockBits)
       {
-         auto size = get_size(n.get());
-         if (index < size)
-            return get_at(n, index);
-         index -= size;
+         intern_node* intern = owned<intern_node>(*n);
+         n = &intern->m_childs[child_index(intern, level, index)];
       }
+      owned<leaf_node>(*n)->values()[index] = std::move(v);
    }
 
+   void set_at(std::size_t index, value_type const& v)
+   {
+      if (index >= size())
+         throw std::out_of_range("Wrong size");
+      set_in_place(index, v);
+   }
+
+   void pop_back_in_place()
+   {
+      if (empty())
+         throw std::out_of_range("Empty vector");
+
+      if (m_tail->m_count > 1)
+      {
+         leaf_node* tail = owned<leaf_node>(m_tail);
+         tail->values()[--tail->m_count].~value_type();
+      }
+      else
+      {
+         release(m_tail);
+         m_tail = m_root ? pop_leaf() : nullptr;
+      }
+      m_size--;
+   }
+
+   //--------------------------------------------------------------------------
+   // Moving blocks between the tail and the tree (the reference on the block
+   // is transferred)
    //--------------------------------------------------------------------------
 
-   static node_ptr push_back(node_ptr const& n, value_type const& v)
+   void push_leaf(leaf_node* leaf, std::size_t leaf_size)
    {
-      return n->m_kind == kind::leaf ? push_in_leaf(n, v) : push_in_intern(n, v);
+      if (!m_root)
+      {
+         intern_node* root = allocate_intern();
+         append_child(*root, leaf);
+         m_root = root;
+      }
+      else if (!has_room(m_root, m_shift))
+      {
+         intern_node* root = allocate_intern();
+         append_child(*root, m_root);
+         append_child(*root, new_path(m_shift, leaf));
+         m_shift += BlockBits;
+         compute_sizes(*root, m_shift);
+         m_root = root;
+      }
+      else
+      {
+         push_leaf(m_root, m_shift, leaf, leaf_size);
+      }
    }
 
-   static node_ptr push_in_leaf(node_ptr const& n, value_type const& v)
+   static void push_leaf(node*& n, std::size_t level, leaf_node* leaf, std::size_t leaf_size)
    {
-      auto* l = static_cast<leaf_node const*>(n.get());
+      intern_node* parent = owned<intern_node>(n);
+      node*& last = parent->m_childs[parent->m_count - 1];
+      if (level > BlockBits && has_room(last, level - BlockBits))
+      {
+         push_leaf(last, level - BlockBits, leaf, leaf_size);
+         if (parent->m_sizes)
+            parent->m_sizes[parent->m_count - 1] += leaf_size;
+         return;
+      }
+
+      bool was_full = size_of(last, level - BlockBits) == (std::size_t(1) << level);
+      append_child(*parent, new_path(level - BlockBits, leaf));
+      if (parent->m_sizes)
+         parent->m_sizes[parent->m_count - 1] = parent->m_sizes[parent->m_count - 2] + leaf_size;
+      else if (!was_full)
+         compute_sizes(*parent, level);
+   }
 
-      if (l->m_values.size() >= BlockSize)
+   static node* new_path(std::size_t level, node* n)
+   {
+      if (0 == level)
+         return n;
+
+      intern_node* out = allocate_intern();
+      append_child(*out, new_path(level - BlockBits, n));
+      return out;
+   }
+
+   /** Remove the last block of the tree */
+   leaf_node* pop_leaf()
+   {
+      node* leaf = pop_leaf(m_root, m_shift);
+      if (0 == m_root->m_count)
+      {
+         release(m_root);
+         m_root = nullptr;
+         m_shift = BlockBits;
+      }
+      else
+      {
+         shrink_root();
+      }
+      return as_leaf(leaf);
+   }
+
+   static node* pop_leaf(node*& n, std::size_t level)
+   {
+      intern_node* parent = owned<intern_node>(n);
+      node*& last = parent->m_childs[parent->m_count - 1];
+      node* leaf = nullptr;
+      if (level == BlockBits)
+      {
+         leaf = last;
+         parent->m_count--;
+      }
+      else
       {
-         std::shared_ptr<intern_node> out(new intern_node());
-         out->m_first = 0;
-         out->m_last = BlockSize + 1;
-         out->m_childs.push_back(n);
-         out->m_childs.push_back(create_leaf(v));
-         return std::move(out);
+         leaf = pop_leaf(last, level - BlockBits);
+         if (0 == last->m_count)
+         {
+            release(last);
+            parent->m_count--;
+         }
       }
 
-      std::shared_ptr<leaf_node> out(new leaf_node(*l));
-      out->m_values.push_back(v);
-      return std::move(out);
+      if (parent->m_sizes && parent->m_count > 0)
+      {
+         std::size_t before = parent->m_count > 1 ? parent->m_sizes[parent->m_count - 2] : 0;
+         parent->m_sizes[parent->m_count - 1] = before + size_of(parent->m_childs[parent->m_count - 1], level - BlockBits);
+      }
+      return leaf;
    }
 
-   static node_ptr push_in_intern(node_ptr const& n, value_type const& v)
+   void shrink_root()
    {
-      auto* i = static_cast<intern_node const*>(n.get());
+      while (m_shift > BlockBits && 1 == m_root->m_count)
+      {
+         node* child = as_intern(m_root)->m_childs[0];
+         acquire(child);
+         release(m_root);
+         m_root = child;
+         m_shift -= BlockBits;
+      }
+   }
 
-      std::size_t first_size = max_size(i->m_childs[0].get());
-      auto it = find_if(begin(i->m_childs), end(i->m_childs),
-         [&](auto const& n) { return first_size > get_size(n.get()); });
+   //--------------------------------------------------------------------------
+   // Slicing: only the nodes along the cut are copied
+   //--------------------------------------------------------------------------
 
-      if (it != end(i->m_childs))
+   static node* take_tree(node* n, std::size_t level, std::size_t count)
+   {
+      if (size_of(n, level) == count)
       {
-         auto index = distance(begin(i->m_childs), it);
-         std::shared_ptr<intern_node> out(new intern_node(*i));
-         out->m_last++;
-         out->m_childs[index] = push_back(*it, v);
-         return std::move(out);
+         acquire(n);
+         return n;
       }
-      else if (i->m_childs.size() < BlockSize)
+
+      if (0 == level)
+         return copy_leaf(as_leaf(n), 0, count);
+
+      intern_node const* intern = as_intern(n);
+      std::size_t last = count - 1;
+      std::size_t child = child_index(intern, level, last);
+
+      intern_node* out = allocate_intern();
+      append_childs(*out, intern->m_childs, intern->m_childs + child);
+      append_child(*out, take_tree(intern->m_childs[child], level - BlockBits, last + 1));
+      if (intern->m_sizes)
       {
-         std::shared_ptr<intern_node> out(new intern_node(*i));
-         out->m_last++;
-         out->m_childs.push_back(create_leaf(v));
-         return std::move(out);
+         set_relaxed(*out, true);
+         std::copy(intern->m_sizes, intern->m_sizes + child, out->m_sizes);
+         out->m_sizes[child] = count;
       }
+      return out;
+   }
+
+   static node* drop_tree(node* n, std::size_t level, std::size_t count)
+   {
+      if (0 == level)
+         return copy_leaf(as_leaf(n), count, n->m_count);
+
+      intern_node const* intern = as_intern(n);
+      std::size_t first = count;
+      std::size_t child = child_index(intern, level, first);
+
+      intern_node* out = allocate_intern();
+      if (0 == first)
+         append_childs(*out, intern->m_childs + child, intern->m_childs + child + 1);
       else
+         append_child(*out, drop_tree(intern->m_childs[child], level - BlockBits, first));
+      append_childs(*out, intern->m_childs + child + 1, intern->m_childs + intern->m_count);
+      compute_sizes(*out, level);
+      return out;
+   }
+
+   //--------------------------------------------------------------------------
+   // Concatenation: the two trees are zipped along their junction, and the
+   // nodes around the junction are redistributed so that there are at most
+   // ExtraBlocks more nodes than the optimal count. The result of zipping two
+   // trees at 'level' is a node at 'level + BlockBits' with one or two childs.
+   //--------------------------------------------------------------------------
+
+   using slots = std::vector<node*>;
+
+   static node* first_child(node* n) { return as_intern(n)->m_childs[0]; }
+   static node* last_child(node* n)  { return as_intern(n)->m_childs[n->m_count - 1]; }
+
+   static node* concat_trees(node* left, std::size_t left_level, node* right, std::size_t right_level)
+   {
+      if (left_level > right_level)
+      {
+         node* centre = concat_trees(last_child(left), left_level - BlockBits, right, right_level);
+         return rebalance(as_intern(left), centre, nullptr, left_level);
+      }
+
+      if (left_level < right_level)
+      {
+         node* centre = concat_trees(left, left_level, first_child(right), right_level - BlockBits);
+         return rebalance(nullptr, centre, as_intern(right), right_level);
+      }
+
+      if (0 == left_level)
       {
-         std::shared_ptr<intern_node> out(new intern_node());
-         out->m_last = 1 + i->m_last;
-         out->m_height = 1 + i->m_height;
-         out->m_childs.push_back(n);
-         out->m_childs.push_back(create_leaf(v));
+         intern_node* out = allocate_intern();
+         append_childs(*out, &left, &left + 1);
+         append_childs(*out, &right, &right + 1);
+         compute_sizes(*out, BlockBits);
          return out;
       }
+
+      node* centre = concat_trees(last_child(left), left_level - BlockBits, first_child(right), right_level - BlockBits);
+      return rebalance(as_intern(left), centre, as_intern(right), left_level);
+   }
+
+   /** Takes the reference on 'centre' */
+   static node* rebalance(intern_node const* left, node* centre, intern_node const* right, std::size_t level)
+   {
+      slots all;
+      if (left)
+         all.insert(all.end(), left->m_childs, left->m_childs + left->m_count - 1);
+      all.insert(all.end(), as_intern(centre)->m_childs, as_intern(centre)->m_childs + centre->m_count);
+      if (right)
+         all.insert(all.end(), right->m_childs + 1, right->m_childs + right->m_count);
+
+      slots merged = redistribute(all, level - BlockBits);
+      release(centre);
+
+      intern_node* out = allocate_intern();
+      for (std::size_t first = 0; first < merged.size(); first += BlockSize)
+      {
+         intern_node* n = allocate_intern();
+         std::size_t last = std::min(first + BlockSize, merged.size());
+         std::for_each(merged.begin() + first, merged.begin() + last, [n](node* child) { append_child(*n, child); });
+         compute_sizes(*n, level);
+         append_child(*out, n);
+      }
+      compute_sizes(*out, level + BlockBits);
+      return out;
+   }
+
+   /**
+    * Merge the under-filled nodes so that there are at most ExtraBlocks more
+    * nodes than needed. Returns new references on the resulting nodes.
+    */
+   static slots redistribute(slots const& all, std::size_t level)
+   {
+      std::vector<std::size_t> counts(all.size());
+      std::size_t total = 0;
+      for (std::size_t i = 0; i < all.size(); ++i)
+      {
+         counts[i] = all[i]->m_count;
+         total += counts[i];
+      }
+
+      std::size_t optimal = (total + BlockSize - 1) / BlockSize;
+      std::size_t node_count = counts.size();
+      if (node_count <= optimal + ExtraBlocks)
+      {
+         std::for_each(all.begin(), all.end(), acquire);
+         return all;
+      }
+
+      //Plan: spread the content of an under-filled node over the next ones
+      for (std::size_t i = 0; node_count > optimal + ExtraBlocks; --i)
+      {
+         while (counts[i] >= BlockSize - ExtraBlocks / 2)
+            ++i;
+
+         std::size_t remaining = counts[i];
+         do
+         {
+            std::size_t merged = std::min(remaining + counts[i + 1], BlockSize);
+            remaining = remaining + counts[i + 1] - merged;
+            counts[i] = merged;
+            ++i;
+         } while (remaining > 0);
+
+         std::copy(counts.begin() + i + 1, counts.begin() + node_count, counts.begin() + i);
+         --node_count;
+      }
+
+      //Execution: the nodes whose content does not move are kept as is
+      slots out;
+      std::size_t slot = 0;
+      std::size_t offset = 0;
+      for (std::size_t i = 0; i < node_count; ++i)
+      {
+         if (0 == offset && counts[i] == all[slot]->m_count)
+         {
+            acquire(all[slot]);
+            out.push_back(all[slot++]);
+         }
+         else
+         {
+            out.push_back(gather(all, slot, offset, counts[i], level));
+         }
+      }
+      return out;
+   }
+
+   static node* gather(slots const& all, std::size_t& slot, std::size_t& offset, std::size_t count, std::size_t level)
+   {
+      leaf_node* leaf = 0 == level ? allocate_leaf() : nullptr;
+      intern_node* intern = 0 == level ? nullptr : allocate_intern();
+      while (count > 0)
+      {
+         node* from = all[slot];
+         std::size_t taken = std::min<std::size_t>(count, from->m_count - offset);
+         if (leaf)
+         {
+            std::uninitialized_copy(as_leaf(from)->values() + offset, as_leaf(from)->values() + offset + taken, leaf->values() + leaf->m_count);
+            leaf->m_count += static_cast<std::uint32_t>(taken);
+         }
+         else
+         {
+            append_childs(*intern, as_intern(from)->m_childs + offset, as_intern(from)->m_childs + offset + taken);
+         }
+
+         count -= taken;
+         offset += taken;
+         if (offset == from->m_count)
+         {
+            ++slot;
+            offset = 0;
+         }
+      }
+
+      if (leaf)
+         return leaf;
+      compute_sizes(*intern, level);
+      return intern;
    }
 };
+
+//-----------------------------------------------------------------------------
+
+/**
+ * A builder for persistent vectors, updated in place
+ *
+ * The blocks created by the builder are owned by it and updated in place,
+ * so that building a vector of N elements allocates about N / 32 blocks.
+ * The blocks shared with a persistent vector are copied before being updated.
+ *
+ * 'persistent' returns the content of the builder in O(1): the builder stays
+ * usable, but the blocks are then shared and copied on the next updates.
+ */
+template<
+   typename value_type,
+   typename Threading = details::multi_threaded
+>
+class transient_vector
+{
+public:
+   transient_vector() = default;
+   explicit transient_vector(persistent_vector<value_type, Threading> const& v) : m_vector(v) {}
+
+   std::size_t size() const
+   {
+      return m_vector.size();
+   }
+
+   value_type const& at(std::size_t index) const
+   {
+      return m_vector.at(index);
+   }
+
+   void push_back(value_type const& v)
+   {
+      m_vector.push_back_in_place(v);
+   }
+
+   void push_back(value_type&& v)
+   {
+      m_vector.push_back_in_place(std::move(v));
+   }
+
+   void set(std::size_t index, value_type v)
+   {
+      if (index >= size())
+         throw std::out_of_range("Wrong size");
+      m_vector.set_in_place(index, std::move(v));
+   }
+
+   template<typename Iterator>
+   void append(Iterator first, Iterator last)
+   {
+      for (; first != last; ++first)
+         m_vector.push_back_in_place(*first);
+   }
+
+   persistent_vector<value_type, Threading> persistent() const
+   {
+      return m_vector;
+   }
+
+private:
+   persistent_vector<value_type, Threading> m_vector;
+};
+
+template<typename value_type, typename Threading>
+transient_vector<value_type, Threading> persistent_vector<value_type, Threading>::transient() const
+{
+   return transient_vector<value_type, Threading>(*this);
+}
+
+//-----------------------------------------------------------------------------
+
+namespace details
+{
+   //--------------------------------------------------------------------------
+   // Forward iterator on the chunks of a persistent vector: the blocks of the
+   // tree from left to right, then the tail
+   //--------------------------------------------------------------------------
+
+   template<typename Vector>
+   class pv_chunk_iterator
+   {
+   private:
+      using node = typename Vector::node;
+      using leaf_node = typename Vector::leaf_node;
+      using intern_node = typename Vector::intern_node;
+
+      struct frame
+      {
+         intern_node const* m_node;
+         std::uint32_t      m_next; //Next child to visit
+      };
+
+   public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = typename Vector::chunk;
+      using difference_type = std::ptrdiff_t;
+      using pointer = value_type const*;
+      using reference = value_type const&;
+
+      pv_chunk_iterator() : m_stack(), m_depth(0), m_tail(nullptr), m_current() {}
+
+      reference operator*() const { return m_current; }
+      pointer operator->() const { return &m_current; }
+
+      pv_chunk_iterator& operator++()
+      {
+         next();
+         return *this;
+      }
+
+      pv_chunk_iterator operator++(int)
+      {
+         pv_chunk_iterator out(*this);
+         next();
+         return out;
+      }
+
+      bool operator==(pv_chunk_iterator const& other) const { return m_current.begin() == other.m_current.begin(); }
+      bool operator!=(pv_chunk_iterator const& other) const { return m_current.begin() != other.m_current.begin(); }
+
+   private:
+      friend Vector;
+
+      std::array<frame, Vector::MaxDepth> m_stack;
+      std::size_t                         m_depth;
+      leaf_node const*                    m_tail;  //Tail left to visit
+      value_type                          m_current;
+
+      pv_chunk_iterator(node const* root, leaf_node const* tail) : m_stack(), m_depth(0), m_tail(tail), m_current()
+      {
+         if (root)
+            m_stack[m_depth++] = { static_cast<intern_node const*>(root), 0 };
+         next();
+      }
+
+      void next()
+      {
+         while (m_depth)
+         {
+            frame& top = m_stack[m_depth - 1];
+            if (top.m_next == top.m_node->m_count)
+            {
+               --m_depth;
+               continue;
+            }
+
+            node const* child = top.m_node->m_childs[top.m_next++];
+            if (Vector::kind::leaf == child->m_kind)
+            {
+               set_current(static_cast<leaf_node const*>(child));
+               return;
+            }
+            m_stack[m_depth++] = { static_cast<intern_node const*>(child), 0 };
+         }
+
+         if (m_tail)
+         {
+            set_current(m_tail);
+            m_tail = nullptr;
+            return;
+         }
+         m_current = value_type();
+      }
+
+      void set_current(leaf_node const* leaf)
+      {
+         m_current = value_type(leaf->values(), leaf->values() + leaf->m_count);
+      }
+   };
+
+   //--------------------------------------------------------------------------
+   // Forward iterator on the elements of a persistent vector
+   //--------------------------------------------------------------------------
+
+   template<typename Vector>
+   class pv_const_iterator
+   {
+   public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = typename Vector::element;
+      using difference_type = std::ptrdiff_t;
+      using pointer = value_type const*;
+      using reference = value_type const&;
+
+      pv_const_iterator() : m_chunk(), m_current(nullptr) {}
+
+      reference operator*() const { return *m_current; }
+      pointer operator->() const { return m_current; }
+
+      pv_const_iterator& operator++()
+      {
+         if (++m_current == m_chunk->end())
+            m_current = (++m_chunk)->begin();
+         return *this;
+      }
+
+      pv_const_iterator operator++(int)
+      {
+         pv_const_iterator out(*this);
+         ++(*this);
+         return out;
+      }
+
+      bool operator==(pv_const_iterator const& other) const { return m_current == other.m_current; }
+      bool operator!=(pv_const_iterator const& other) const { return m_current != other.m_current; }
+
+   private:
+      friend Vector;
+
+      typename Vector::chunk_iterator m_chunk;
+      value_type const*               m_current;
+
+      explicit pv_const_iterator(typename Vector::chunk_iterator chunk) : m_chunk(chunk), m_current(chunk->begin()) {}
+   };
+}
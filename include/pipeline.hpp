@@ -0,0 +1,315 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <fold_balanced.hpp>
+#include <internal/parallel.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace details
+{
+   //--------------------------------------------------------------------------
+   // Sinks: the functions called on each element out of a stage
+   // - The stages wrap the sink of the next stage into a sink of their own, so
+   //   that the whole pipeline is a single sink called on each input element
+   // - At the end of the input, the sinks are flushed (if they have a flush)
+   //--------------------------------------------------------------------------
+
+   template<typename Sink>
+   auto flush_sink(Sink& sink, int) -> decltype(sink.flush(), void())
+   {
+      sink.flush();
+   }
+
+   template<typename Sink>
+   void flush_sink(Sink&, long)
+   {
+   }
+
+   template<typename Predicate, typename Sink>
+   struct filter_sink
+   {
+      Predicate m_pred;
+      Sink      m_sink;
+
+      template<typename Value>
+      void operator()(Value&& value)
+      {
+         if (m_pred(value))
+            m_sink(std::forward<Value>(value));
+      }
+
+      void flush()
+      {
+         flush_sink(m_sink, 0);
+      }
+   };
+
+   /**
+    * Filter of small trivially copyable values, without branch on the result
+    * of the predicate: each value is copied to a buffer, which only grows
+    * with the values selected, and the buffer is emptied to the next sink
+    * when full
+    */
+   template<typename Value, typename Predicate, typename Sink>
+   struct buffered_filter_sink
+   {
+      static const std::size_t BufferSize = 64;
+
+      Predicate                        m_pred;
+      Sink                             m_sink;
+      std::array<Value, BufferSize>    m_buffer {};
+      std::size_t                      m_count = 0;
+
+      void operator()(Value const& value)
+      {
+         m_buffer[m_count] = value;
+         m_count += m_pred(m_buffer[m_count]) ? 1 : 0;
+         if (m_count == BufferSize)
+            empty_buffer();
+      }
+
+      void flush()
+      {
+         empty_buffer();
+         flush_sink(m_sink, 0);
+      }
+
+   private:
+      void empty_buffer()
+      {
+         for (std::size_t i = 0; i < m_count; ++i)
+            m_sink(m_buffer[i]);
+         m_count = 0;
+      }
+   };
+
+   template<typename Value>
+   constexpr bool is_bufferable = std::is_trivially_copyable<Value>::value && std::is_default_constructible<Value>::value && sizeof(Value) <= 16;
+
+   template<typename UnaryOp, typename Sink>
+   struct transform_sink
+   {
+      UnaryOp m_op;
+      Sink    m_sink;
+
+      template<typename Value>
+      void operator()(Value&& value)
+      {
+         m_sink(m_op(std::forward<Value>(value)));
+      }
+
+      void flush()
+      {
+         flush_sink(m_sink, 0);
+      }
+   };
+
+   //--------------------------------------------------------------------------
+   // Stages of a pipeline
+   // 'output<Input>' is the type of the values out of the stage, when the
+   // elements of the range are of type 'Input'
+   //--------------------------------------------------------------------------
+
+   struct source_stage
+   {
+      template<typename Input>
+      using output = Input;
+
+      template<typename Input, typename Sink>
+      Sink wrap(Sink sink) const
+      {
+         return sink;
+      }
+   };
+
+   template<typename Previous, typename Predicate>
+   struct filter_stage
+   {
+      Previous  m_previous;
+      Predicate m_pred;
+
+      template<typename Input>
+      using output = typename Previous::template output<Input>;
+
+      template<typename Input, typename Sink>
+      auto wrap(Sink sink) const
+      {
+         using value_type = output<Input>;
+         if constexpr (is_bufferable<value_type>)
+            return m_previous.template wrap<Input>(buffered_filter_sink<value_type, Predicate, Sink>{ m_pred, sink });
+         else
+            return m_previous.template wrap<Input>(filter_sink<Predicate, Sink>{ m_pred, sink });
+      }
+   };
+
+   template<typename Previous, typename UnaryOp>
+   struct transform_stage
+   {
+      Previous m_previous;
+      UnaryOp  m_op;
+
+      template<typename Input>
+      using output = std::decay_t<std::invoke_result_t<UnaryOp&, typename Previous::template output<Input>&>>;
+
+      template<typename Input, typename Sink>
+      auto wrap(Sink sink) const
+      {
+         return m_previous.template wrap<Input>(transform_sink<UnaryOp, Sink>{ m_op, sink });
+      }
+   };
+}
+
+
+//-----------------------------------------------------------------------------
+// Lazy pipeline of filters and transformations over a range
+// - Building the pipeline does not touch the range
+// - Folding it runs all the stages on each element in a single pass, without
+//   intermediary ranges (filters of small trivially copyable values keep the
+//   selected values in a small buffer, to avoid a branch per element)
+// - The parallel folds cut the range in chunks (random access iterators only)
+//   and call the stages concurrently, each chunk on its own copy of them
+//-----------------------------------------------------------------------------
+
+template<typename Iterator, typename Stages = details::source_stage>
+class pipeline
+{
+public:
+   pipeline(Iterator first, Iterator last, Stages stages = Stages())
+      : m_first(first), m_last(last), m_stages(stages)
+   {}
+
+   template<typename Predicate>
+   pipeline<Iterator, details::filter_stage<Stages, Predicate>> filter(Predicate pred) const
+   {
+      return { m_first, m_last, { m_stages, pred } };
+   }
+
+   template<typename UnaryOp>
+   pipeline<Iterator, details::transform_stage<Stages, UnaryOp>> transform(UnaryOp op) const
+   {
+      return { m_first, m_last, { m_stages, op } };
+   }
+
+   template<typename Sink>
+   void for_each(Sink sink) const
+   {
+      for_each(m_first, m_last, sink);
+   }
+
+   template<typename Result, typename BinaryOp>
+   Result fold(Result init, BinaryOp op) const
+   {
+      for_each([&](auto&& value) { init = op(std::move(init), std::forward<decltype(value)>(value)); });
+      return init;
+   }
+
+   /** Same as fold_balanced on the elements out of the pipeline */
+   template<typename Result, typename BinaryOp>
+   Result fold_balanced(Result init, BinaryOp op) const
+   {
+      BalancedAccumulator<BinaryOp, Result> acc(op, 64);
+      for_each(std::ref(acc));
+      return acc.finalize(init);
+   }
+
+   /**
+    * Balanced fold on up to 'thread_count' threads: each chunk of the range
+    * is accumulated on its own, then the accumulators are merged in order,
+    * their partial results keeping the number of elements they fold. With an
+    * associative operation, the result is the same as fold_balanced, up to
+    * the rounding of floating point numbers.
+    */
+   template<typename Result, typename BinaryOp>
+   Result parallel_fold_balanced(Result init, BinaryOp op, std::size_t thread_count = details::default_thread_count()) const
+   {
+      using accumulator = BalancedAccumulator<BinaryOp, Result>;
+      std::vector<std::optional<accumulator>> partials = fold_chunks(thread_count, [&](Iterator first, Iterator last) {
+         std::optional<accumulator> acc(std::in_place, op, 64);
+         for_each(first, last, std::ref(*acc));
+         return acc;
+      });
+
+      accumulator acc(op, 64);
+      for (auto& partial : partials)
+         acc.merge(std::move(*partial));
+      return acc.finalize(init);
+   }
+
+   /** Left fold on up to 'thread_count' threads, the results of the chunks being combined with 'op' too */
+   template<typename Result, typename BinaryOp>
+   Result parallel_fold(Result init, BinaryOp op, std::size_t thread_count = details::default_thread_count()) const
+   {
+      std::vector<std::optional<Result>> partials = fold_chunks(thread_count, [&](Iterator first, Iterator last) {
+         std::optional<Result> result;
+         for_each(first, last, [&](auto&& value) {
+            if (result)
+               result = op(std::move(*result), std::forward<decltype(value)>(value));
+            else
+               result = Result(std::forward<decltype(value)>(value));
+         });
+         return result;
+      });
+
+      for (auto& partial : partials)
+      {
+         if (partial)
+            init = op(std::move(init), std::move(*partial));
+      }
+      return init;
+   }
+
+private:
+   static const std::size_t TasksPerThread = 8;
+
+   Iterator m_first;
+   Iterator m_last;
+   Stages   m_stages;
+
+   template<typename Sink>
+   void for_each(Iterator first, Iterator last, Sink sink) const
+   {
+      using input = typename std::iterator_traits<Iterator>::value_type;
+      auto run = m_stages.template wrap<input>(sink);
+      for (; first != last; ++first)
+         run(*first);
+      details::flush_sink(run, 0);
+   }
+
+   /** The result of 'fold_chunk(first, last)' for each chunk of the range, in order */
+   template<typename FoldChunk>
+   auto fold_chunks(std::size_t thread_count, FoldChunk fold_chunk) const
+   {
+      std::size_t size = m_last - m_first;
+      std::size_t chunk_count = std::max<std::size_t>(1, std::min(size, TasksPerThread * thread_count));
+      std::vector<decltype(fold_chunk(m_first, m_last))> partials(chunk_count);
+      details::parallel_for(chunk_count, [&](std::size_t c) {
+         partials[c] = fold_chunk(m_first + details::chunk_start(size, chunk_count, c), m_first + details::chunk_start(size, chunk_count, c + 1));
+      }, thread_count);
+      return partials;
+   }
+};
+
+template<typename Iterator>
+pipeline<Iterator> make_pipeline(Iterator first, Iterator last)
+{
+   return pipeline<Iterator>(first, last);
+}
+
+template<typename Container>
+auto make_pipeline(Container const& container)
+{
+   return make_pipeline(begin(container), end(container));
+}
+
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef RADIX_SORT_HPP
+#define RADIX_SORT_HPP
+
+#include <internal/parallel.hpp>
+#include <internal/radix_sort.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+
+//-----------------------------------------------------------------------------
+// Radix sort (least significant digit first)
+// Sort in linear time, if the inputs can be projected on integer or floating
+// point keys, whatever the range of the keys
+// - A stable counting sort on each digit of 11 bits, from the lowest one
+// - The elements go back and forth between the input and a buffer, and the
+//   digits shared by all keys are skipped
+// - The elements must be default constructible (for the buffer)
+//-----------------------------------------------------------------------------
+
+template<typename RandomIterator, typename Projection>
+void radix_sort(RandomIterator first, RandomIterator last, Projection proj)
+{
+   if (last - first < 2)
+      return;
+
+   using ValueType = typename std::iterator_traits<RandomIterator>::value_type;
+   using Bits = decltype(details::radix_key(proj(*first)));
+   auto key_of = [&proj](ValueType const& v) { return details::radix_key(proj(v)); };
+
+   details::radix_histograms<Bits> histograms;
+   histograms.count(first, last, key_of);
+
+   std::vector<ValueType> buffer;
+   bool in_buffer = false;
+   for (std::size_t pass = 0; pass < histograms.Passes; ++pass)
+   {
+      if (histograms.is_constant(pass))
+         continue;
+
+      if (buffer.empty())
+         buffer.resize(last - first);
+
+      auto starts = histograms.starts(pass);
+      if (in_buffer)
+         details::radix_scatter(begin(buffer), end(buffer), first, starts, pass, key_of);
+      else
+         details::radix_scatter(first, last, begin(buffer), starts, pass, key_of);
+      in_buffer = !in_buffer;
+   }
+
+   if (in_buffer)
+      std::move(begin(buffer), end(buffer), first);
+}
+
+template<typename RandomIterator>
+void radix_sort(RandomIterator first, RandomIterator last)
+{
+   radix_sort(first, last, [](auto const& v) { return v; });
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Parallel radix sort, on up to 'thread_count' threads
+// - Each thread counts the digits of a range of the input, before each pass
+// - A prefix sum over all the counts gives each range its own slots in each
+//   bucket, so that the threads scatter their range without synchronization
+//   and each pass stays stable
+//-----------------------------------------------------------------------------
+
+template<typename RandomIterator, typename Projection>
+void parallel_radix_sort(RandomIterator first, RandomIterator last, Projection proj,
+                         std::size_t thread_count = details::default_thread_count())
+{
+   if (last - first < 2)
+      return;
+
+   using ValueType = typename std::iterator_traits<RandomIterator>::value_type;
+   using Bits = decltype(details::radix_key(proj(*first)));
+   auto key_of = [&proj](ValueType const& v) { return details::radix_key(proj(v)); };
+
+   std::size_t size = last - first;
+   std::size_t range_count = std::max<std::size_t>(1, std::min(thread_count, size));
+   auto range_start = [=](std::size_t r) { return details::chunk_start(size, range_count, r); };
+
+   std::vector<details::radix_histograms<Bits>> range_histograms(range_count);
+   details::parallel_for(range_count, [&](std::size_t r) {
+      range_histograms[r].count(first + range_start(r), first + range_start(r + 1), key_of);
+   }, thread_count);
+
+   details::radix_histograms<Bits> histograms;
+   for (auto const& h : range_histograms)
+      histograms += h;
+
+   std::unique_ptr<ValueType[]> buffer;
+   std::vector<details::radix_counts> starts(range_count);
+   bool in_buffer = false;
+   for (std::size_t pass = 0; pass < histograms.Passes; ++pass)
+   {
+      if (histograms.is_constant(pass))
+         continue;
+
+      if (!buffer)
+         buffer.reset(new ValueType[size]);
+
+      auto scatter = [&](auto src, auto dst) {
+         details::parallel_for(range_count, [&](std::size_t r) {
+            starts[r] = details::count_digits(src + range_start(r), src + range_start(r + 1), pass, key_of);
+         }, thread_count);
+         details::radix_starts(starts);
+         details::parallel_for(range_count, [&](std::size_t r) {
+            details::radix_scatter(src + range_start(r), src + range_start(r + 1), dst, starts[r], pass, key_of);
+         }, thread_count);
+      };
+
+      if (in_buffer)
+         scatter(buffer.get(), first);
+      else
+         scatter(first, buffer.get());
+      in_buffer = !in_buffer;
+   }
+
+   if (in_buffer)
+   {
+      details::parallel_for(range_count, [&](std::size_t r) {
+         std::move(buffer.get() + range_start(r), buffer.get() + range_start(r + 1), first + range_start(r));
+      }, thread_count);
+   }
+}
+
+template<typename RandomIterator>
+void parallel_radix_sort(RandomIterator first, RandomIterator last)
+{
+   parallel_radix_sort(first, last, [](auto const& v) { return v; });
+}
+
+
+//-----------------------------------------------------------------------------
+// Radix sort in place (most significant digit first)
+// Sort keys of variable length, such as strings or composite keys, without
+// comparing them byte by byte from the start each time
+// - 'key_byte(value, depth)' gives the byte of the key at 'depth' (in [0, 256))
+//   or -1 past the end of the key
+// - The elements are permuted in place bucket by bucket (American flag sort)
+//   and the small buckets are finished with an insertion sort
+// - Not stable: the elements with equal keys may be reordered
+//-----------------------------------------------------------------------------
+
+template<typename RandomIterator, typename KeyByte>
+void msd_radix_sort(RandomIterator first, RandomIterator last, KeyByte key_byte)
+{
+   details::msd_radix_sort(details::msd_range<RandomIterator>{ first, last, 0 }, key_byte);
+}
+
+template<typename RandomIterator>
+void msd_radix_sort(RandomIterator first, RandomIterator last)
+{
+   msd_radix_sort(first, last, details::string_key_byte());
+}
+
+/**
+ * Parallel radix sort in place, on up to 'thread_count' threads: the first
+ * levels of buckets are partitioned by the calling thread, until the buckets
+ * are small enough to be sorted as independent tasks, largest first
+ */
+template<typename RandomIterator, typename KeyByte,
+         typename = std::enable_if_t<details::is_key_byte<KeyByte, RandomIterator>>>
+void parallel_msd_radix_sort(RandomIterator first, RandomIterator last, KeyByte key_byte,
+                             std::size_t thread_count = details::default_thread_count())
+{
+   using range = details::msd_range<RandomIterator>;
+   const std::size_t TasksPerThread = 8;
+
+   thread_count = std::max<std::size_t>(1, thread_count);
+   std::size_t task_size = std::max(details::MsdInsertionSortSize, std::size_t(last - first) / (TasksPerThread * thread_count));
+   std::vector<range> ranges { range{ first, last, 0 } };
+   std::vector<range> tasks;
+   std::vector<std::uint16_t> buckets;
+   while (!ranges.empty())
+   {
+      range r = ranges.back();
+      ranges.pop_back();
+      if (r.size() <= task_size)
+      {
+         tasks.push_back(r);
+         continue;
+      }
+
+      details::msd_offsets ends = details::msd_partition(r, key_byte, buckets);
+      details::push_buckets(r, ends, ranges);
+   }
+
+   std::sort(begin(tasks), end(tasks), [](range const& lhs, range const& rhs) { return lhs.size() > rhs.size(); });
+   details::parallel_for(tasks.size(), [&](std::size_t i) {
+      details::msd_radix_sort(tasks[i], key_byte);
+   }, thread_count);
+}
+
+template<typename RandomIterator>
+void parallel_msd_radix_sort(RandomIterator first, RandomIterator last,
+                             std::size_t thread_count = details::default_thread_count())
+{
+   parallel_msd_radix_sort(first, last, details::string_key_byte(), thread_count);
+}
+
+#endif
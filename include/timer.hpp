@@ -68,7 +68,7 @@ template<typename Unit, typename Fct, typename... Args>
 auto time(Duration<Unit>& duration, Fct&& fct, Args&&... args)
 {
    scoped_timer<Unit> timer(duration);
-   return fct(forward<Args>(args)...); //Also works for void
+   return fct(std::forward<Args>(args)...); //Also works for void
 }
 
 